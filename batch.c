@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "compiler.h"
+#include "memory.h"
+#include "stats.h"
+
+// The scripts a worker has left, as the range [head, tail) of script indices. The owner takes from
+// the head; thieves split off the back half.
+typedef struct {
+      pthread_mutex_t lock;
+      int head;
+      int tail;
+} Deque;
+
+typedef struct {
+      pthread_t thread;
+      int id;
+      Deque deque;
+      Chunk chunk;
+      char* source;
+      size_t sourceCapacity;
+      Diagnostics diagnostics; // The current script's compile errors; reused from one script to the next.
+} Worker;
+
+static const char** batchPaths;
+static BatchResult* batchResults;
+static Worker* workers;
+static int workerCount;
+
+static int takeOwn(Worker* worker) {
+      int script = -1;
+      pthread_mutex_lock(&worker->deque.lock);
+      if (worker->deque.head < worker->deque.tail) script = worker->deque.head++;
+      pthread_mutex_unlock(&worker->deque.lock);
+      return script;
+}
+
+// Moves the back half of the first non-empty deque after the worker's own into its deque, and returns
+// false if every deque was empty. Nothing is added once the batch starts, so the worker can then stop.
+static bool steal(Worker* worker) {
+      for (int i = 1; i < workerCount; i++) {
+            Deque* victim = &workers[(worker->id + i) % workerCount].deque;
+            pthread_mutex_lock(&victim->lock);
+            int remaining = victim->tail - victim->head;
+            int head = victim->tail - (remaining + 1) / 2;
+            int tail = victim->tail;
+            if (remaining > 0) victim->tail = head;
+            pthread_mutex_unlock(&victim->lock);
+            if (remaining == 0) continue;
+
+            pthread_mutex_lock(&worker->deque.lock);
+            worker->deque.head = head;
+            worker->deque.tail = tail;
+            pthread_mutex_unlock(&worker->deque.lock);
+            return true;
+      }
+      return false;
+}
+
+// Reads the whole file into the worker's source buffer, growing it only when a file is larger than any before.
+static bool readSource(Worker* worker, const char* path) {
+      FILE* file = fopen(path, "rb");
+      if (file == NULL) return false;
+
+      fseek(file, 0L, SEEK_END);
+      long size = ftell(file);
+      rewind(file);
+      if (size < 0) {
+            fclose(file);
+            return false;
+      }
+
+      if (worker->sourceCapacity < (size_t)size + 1) {
+            size_t oldCapacity = worker->sourceCapacity;
+            worker->sourceCapacity = (size_t)size + 1;
+            worker->source = GROW_ARRAY(char, worker->source, oldCapacity, worker->sourceCapacity);
+      }
+
+      size_t bytesRead = fread(worker->source, sizeof(char), (size_t)size, file);
+      fclose(file);
+      worker->source[bytesRead] = '\0';
+      return bytesRead == (size_t)size;
+}
+
+static void runScript(Worker* worker, int script) {
+      BatchResult* result = &batchResults[script];
+      result->worker = worker->id;
+      result->diagnostics = NULL;
+      result->readable = readSource(worker, batchPaths[script]);
+      if (!result->readable) return;
+
+      uint64_t start = monotonicNanoseconds();
+      resetChunk(&worker->chunk);
+      worker->diagnostics.length = 0;
+      result->status = loadChunk(worker->source, &worker->chunk);
+      if (result->status == INTERPRET_OK) {
+            vm.result = &result->value;
+            result->status = resume(SIZE_MAX);
+      }
+      result->nanoseconds = monotonicNanoseconds() - start;
+
+      if (worker->diagnostics.length > 0) {
+            result->diagnostics = (char*)malloc(worker->diagnostics.length + 1);
+            if (result->diagnostics == NULL) exit(1);
+            memcpy(result->diagnostics, worker->diagnostics.text, worker->diagnostics.length);
+            result->diagnostics[worker->diagnostics.length] = '\0';
+      }
+}
+
+static void* runWorker(void* argument) {
+      Worker* worker = (Worker*)argument;
+      initVM();
+      captureDiagnostics(&worker->diagnostics);
+
+      for (;;) {
+            int script = takeOwn(worker);
+            if (script < 0) {
+                  if (!steal(worker)) break;
+                  continue;
+            }
+            runScript(worker, script);
+      }
+
+      vm.chunk = NULL;
+      freeChunk(&worker->chunk);
+      FREE_ARRAY(char, worker->source, worker->sourceCapacity);
+      captureDiagnostics(NULL);
+      FREE_ARRAY(char, worker->diagnostics.text, worker->diagnostics.capacity);
+      freeCompiler();
+      return NULL;
+}
+
+void runBatch(const char* paths[], int count, int threads, BatchResult results[]) {
+      if (threads < 1) threads = 1;
+      if (threads > count) threads = count > 0 ? count : 1;
+
+      batchPaths = paths;
+      batchResults = results;
+      workerCount = threads;
+      workers = GROW_ARRAY(Worker, NULL, 0, threads);
+
+      for (int i = 0; i < threads; i++) {
+            Worker* worker = &workers[i];
+            worker->id = i;
+            pthread_mutex_init(&worker->deque.lock, NULL);
+            worker->deque.head = (int)((long long)count * i / threads);
+            worker->deque.tail = (int)((long long)count * (i + 1) / threads);
+            initChunk(&worker->chunk);
+            worker->source = NULL;
+            worker->sourceCapacity = 0;
+            worker->diagnostics = (Diagnostics){NULL, 0, 0};
+      }
+
+      for (int i = 0; i < threads; i++) {
+            if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0) {
+                  fprintf(stderr, "Could not start batch worker %d.\n", i);
+                  exit(71);
+            }
+      }
+      for (int i = 0; i < threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+      }
+      // Only now: a worker that has finished can still be the victim of a steal attempt.
+      for (int i = 0; i < threads; i++) {
+            pthread_mutex_destroy(&workers[i].deque.lock);
+      }
+
+      FREE_ARRAY(Worker, workers, threads);
+      workers = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "common.h"
+#include "vm.h"
+
+typedef struct {
+      bool readable;          // False if the file could not be read; `status` is then meaningless.
+      InterpretResult status;
+      Value value;            // The script's result when `status` is INTERPRET_OK.
+      uint64_t nanoseconds;   // Time spent compiling and running the script, excluding reading it.
+      int worker;
+      char* diagnostics;      // The script's compile errors as they would have been printed, or NULL. Free with free().
+} BatchResult;
+
+// Runs every script in `paths` on `threads` worker threads and stores the outcome for `paths[i]` in
+// `results[i]`. Each worker owns its VM, compiler and scanner state and reuses its chunk and source
+// buffer from one script to the next. Workers start with a contiguous share of the scripts and steal
+// half of another worker's remaining share when they run out. Compile errors are collected per script
+// instead of printed, so the caller can report them in input order.
+void runBatch(const char* paths[], int count, int threads, BatchResult results[]);
+
+#endif
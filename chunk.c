@@ -4,11 +4,20 @@
 // 	2.	freeChunk: Releases all memory allocated for a Chunk and resets its fields to prevent dangling pointers. It ensures that 
 //  resources are properly cleaned up, preventing memory leaks in applications using dynamic memory.
 // 	3.	writeChunk: Dynamically appends an instruction and its associated line number to the Chunk. It grows the chunk’s storage 
-//  capacity as needed, allowing for efficient storage of a sequence of bytecode instructions.
+//  in fixed-size segments as needed, so a huge chunk is never reallocated and copied as a whole.
 // 	4.	addConstant: Stores a constant value in the Chunk’s constants array and returns its index for future reference. This 
 //  supports the storage and reuse of constant values in the generated bytecode, optimizing memory and runtime performance.
+// 	5.	resetChunk: Empties a Chunk while keeping its arrays, so the next compilation into it can reuse the memory.
+// 	6.	flattenChunk: Gives a Chunk contiguous code and line arrays to run from, reusing the first segment when it is
+//  the only one instead of copying.
+// 	7.	freezeChunk: Moves a finished Chunk into one contiguous, exactly sized and cache-line-aligned block, removing the
+//  slack left by growth and keeping the data the VM touches next to each other in memory.
 
+#define _POSIX_C_SOURCE 200809L // For `posix_memalign`, which unlike C11's `aligned_alloc` is also declared under -std=c99.
+
+#include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Include necessary headers for custom memory management, value handling, and chunk structure.
 #include "chunk.h"
@@ -20,40 +29,206 @@
 void initChunk(Chunk* chunk) {
     chunk->count = 0;                  // Initialize the count of instructions to zero.
     chunk->capacity = 0;               // Start with zero capacity, which will grow as needed.
-    chunk->code = NULL;                // Set the pointer to the instruction array to NULL (unallocated).
-    chunk->lines = NULL;               // Set the pointer to the line number array to NULL (unallocated).
+    chunk->code = NULL;                // There is no contiguous code until the chunk is flattened or frozen.
+    chunk->lines = NULL;               // Likewise for the line numbers.
+    chunk->codeSegments = NULL;        // No segments are allocated yet.
+    chunk->lineSegments = NULL;
+    chunk->segmentCount = 0;
+    chunk->segmentCapacity = 0;
+    chunk->frozen = NULL;              // A new chunk is writable.
     initValueArray(&chunk->constants); // Initialize the array of constants, which stores constant values used in the chunk.
 }
 
+// Returns the number of bytes segment `index` holds. Only a chunk with a single segment can have a short one.
+static size_t segmentSize(Chunk* chunk, size_t index) {
+    (void)index;
+    return chunk->segmentCount == 1 ? chunk->capacity : CHUNK_SEGMENT_SIZE;
+}
+
+// Frees the code and line storage, whether it is still in segments or already flattened into two arrays.
+static void freeCode(Chunk* chunk) {
+    for (size_t i = 0; i < chunk->segmentCount; i++) {
+        FREE_ARRAY(uint8_t, chunk->codeSegments[i], segmentSize(chunk, i)); // Free each piece of code.
+        FREE_ARRAY(int, chunk->lineSegments[i], segmentSize(chunk, i));     // And the line numbers that go with it.
+    }
+    if (chunk->segmentCount == 0) {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity); // Arrays produced by flattening several segments.
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
+    FREE_ARRAY(uint8_t*, chunk->codeSegments, chunk->segmentCapacity); // Free the segment pointer arrays themselves.
+    FREE_ARRAY(int*, chunk->lineSegments, chunk->segmentCapacity);
+}
+
 // Frees the memory used by a `Chunk` structure, including its code, lines, and constants.
 // After freeing resources, the chunk is reset to an initialized state to avoid dangling pointers.
 // This function is essential to avoid memory leaks in a dynamic memory allocation scenario.
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity); // Free the memory allocated for the instruction array.
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);    // Free the memory allocated for the line number array.
-    freeValueArray(&chunk->constants);                 // Free the memory used by the constants array.
-    initChunk(chunk);                                  // Reinitialize the chunk to a clean state.
+    if (chunk->frozen != NULL) {
+        free(chunk->frozen); // All arrays live in the one block, which was not allocated through `reallocate`.
+        initChunk(chunk);
+        return;
+    }
+
+    freeCode(chunk);                   // Free the code and line numbers, in whichever form they are.
+    freeValueArray(&chunk->constants); // Free the memory used by the constants array.
+    initChunk(chunk);                  // Reinitialize the chunk to a clean state.
+}
+
+// Resets a `Chunk` to empty without releasing its memory.
+// This lets long-lived callers, such as the server, compile many scripts into the same buffers.
+void resetChunk(Chunk* chunk) {
+    if (chunk->frozen != NULL || (chunk->segmentCount == 0 && chunk->code != NULL)) {
+        freeChunk(chunk); // Neither a frozen block nor flattened arrays can be written to.
+        return;
+    }
+
+    chunk->count = 0;           // Keep the segments at their current capacity.
+    chunk->code = NULL;         // The chunk is being written again, so it has to be flattened again.
+    chunk->lines = NULL;
+    chunk->constants.count = 0; // Keep the constants array at its current capacity as well.
+}
+
+// Makes room for at least one more byte. The first segment grows by doubling until it reaches full size;
+// after that each new segment is allocated at full size and nothing already written is moved.
+static void growChunk(Chunk* chunk) {
+    if (chunk->segmentCount == chunk->segmentCapacity) { // Make room for another segment pointer.
+        size_t oldCapacity = chunk->segmentCapacity;
+        chunk->segmentCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->codeSegments = GROW_ARRAY(uint8_t*, chunk->codeSegments, oldCapacity, chunk->segmentCapacity);
+        chunk->lineSegments = GROW_ARRAY(int*, chunk->lineSegments, oldCapacity, chunk->segmentCapacity);
+    }
+
+    if (chunk->segmentCount == 0) { // Start the first segment small.
+        chunk->codeSegments[0] = NULL;
+        chunk->lineSegments[0] = NULL;
+        chunk->segmentCount = 1;
+    }
+
+    if (chunk->capacity < CHUNK_SEGMENT_SIZE) { // Double the first segment, like GROW_ARRAY does for other arrays.
+        size_t oldCapacity = chunk->capacity;
+        chunk->capacity = GROW_CAPACITY(oldCapacity);
+        chunk->codeSegments[0] = GROW_ARRAY(uint8_t, chunk->codeSegments[0], oldCapacity, chunk->capacity);
+        chunk->lineSegments[0] = GROW_ARRAY(int, chunk->lineSegments[0], oldCapacity, chunk->capacity);
+        return;
+    }
+
+    chunk->codeSegments[chunk->segmentCount] = GROW_ARRAY(uint8_t, NULL, 0, CHUNK_SEGMENT_SIZE); // Add a full segment.
+    chunk->lineSegments[chunk->segmentCount] = GROW_ARRAY(int, NULL, 0, CHUNK_SEGMENT_SIZE);
+    chunk->segmentCount++;
+    chunk->capacity += CHUNK_SEGMENT_SIZE;
 }
 
 // Appends a byte of code and its corresponding line number to a `Chunk`.
-// Dynamically grows the storage capacity if necessary, ensuring the chunk can accommodate more instructions.
+// Adds storage if necessary, ensuring the chunk can accommodate more instructions.
 // This function is used to add new instructions to the chunk during bytecode generation.
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
-    if (chunk->capacity < chunk->count + 1) {  // Check if the current capacity is insufficient.
-        int oldCapacity = chunk->capacity;    // Store the old capacity for resizing calculations.
-        chunk->capacity = GROW_CAPACITY(oldCapacity); // Increase the capacity using a growth formula.
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity); // Resize the instruction array.
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);   // Resize the line number array.
+    assert(chunk->frozen == NULL && chunk->code == NULL); // Frozen and flattened chunks are read-only until reset.
+    if (chunk->capacity < chunk->count + 1) growChunk(chunk); // Check if the current capacity is insufficient.
+
+    size_t segment = chunk->count / CHUNK_SEGMENT_SIZE; // Find the segment and position the byte goes to.
+    size_t offset = chunk->count % CHUNK_SEGMENT_SIZE;
+    chunk->codeSegments[segment][offset] = byte; // Add the byte (instruction) to the code.
+    chunk->lineSegments[segment][offset] = line; // Add the corresponding line number.
+    chunk->count++;                              // Increment the count of instructions.
+}
+
+// Copies the chunk's code and line numbers into `code` and `lines` and releases the storage they came from,
+// one segment at a time so that the old and new copies never both exist in full.
+static void moveCode(Chunk* chunk, uint8_t* code, int* lines) {
+    if (chunk->segmentCount == 0) { // Already flattened into two arrays.
+        if (chunk->count > 0) {
+            memcpy(code, chunk->code, chunk->count);
+            memcpy(lines, chunk->lines, sizeof(int) * chunk->count);
+        }
+    } else {
+        for (size_t i = 0; i < chunk->segmentCount; i++) {
+            size_t start = i * CHUNK_SEGMENT_SIZE;
+            size_t length = chunk->count - start < CHUNK_SEGMENT_SIZE ? chunk->count - start : CHUNK_SEGMENT_SIZE;
+            if (start < chunk->count) {
+                memcpy(code + start, chunk->codeSegments[i], length);
+                memcpy(lines + start, chunk->lineSegments[i], sizeof(int) * length);
+            }
+            FREE_ARRAY(uint8_t, chunk->codeSegments[i], segmentSize(chunk, i));
+            FREE_ARRAY(int, chunk->lineSegments[i], segmentSize(chunk, i));
+        }
+        chunk->segmentCount = 0; // Nothing is left for `freeCode` to free per segment,
+        chunk->code = NULL;      // and `code` may have pointed into the first segment.
+        chunk->lines = NULL;
+    }
+
+    freeCode(chunk); // Release what is left: flattened arrays, or the segment pointer arrays.
+    chunk->code = NULL;
+    chunk->lines = NULL;
+    chunk->codeSegments = NULL;
+    chunk->lineSegments = NULL;
+    chunk->segmentCapacity = 0;
+    chunk->capacity = 0;
+}
+
+// Gives the chunk contiguous `code` and `lines`. A chunk that fits in its first segment needs no copy at all.
+void flattenChunk(Chunk* chunk) {
+    if (chunk->code != NULL || chunk->frozen != NULL) return; // Already flat.
+
+    if (chunk->segmentCount <= 1) {
+        chunk->code = chunk->segmentCount == 1 ? chunk->codeSegments[0] : NULL;
+        chunk->lines = chunk->segmentCount == 1 ? chunk->lineSegments[0] : NULL;
+        return;
     }
 
-    chunk->code[chunk->count] = byte; // Add the byte (instruction) to the instruction array.
-    chunk->lines[chunk->count] = line; // Add the corresponding line number to the line number array.
-    chunk->count++;                    // Increment the count of instructions.
+    size_t count = chunk->count;
+    uint8_t* code = GROW_ARRAY(uint8_t, NULL, 0, count);
+    int* lines = GROW_ARRAY(int, NULL, 0, count);
+    moveCode(chunk, code, lines);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->capacity = count;
 }
 
 // Adds a constant value to the `Chunk`'s constants array and returns its index.
 // This function is essential for storing and reusing constant values during bytecode execution.
 int addConstant(Chunk* chunk, Value value) {
+    assert(chunk->frozen == NULL); // The frozen block holds exactly the constants it was built with.
     writeValueArray(&chunk->constants, value); // Add the value to the constants array.
     return chunk->constants.count - 1;        // Return the index of the newly added constant.
+}
+
+// Rounds `size` up to the next multiple of `alignment`, which must be a power of two.
+static size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Copies the chunk into a single block laid out as constants, then code, then line numbers.
+// Constants and code are what `run()` reads, so they come first and share cache lines; lines are only read
+// when reporting errors or disassembling. The block size is rounded up to a whole cache line, so nothing else shares its last line.
+void freezeChunk(Chunk* chunk) {
+    if (chunk->frozen != NULL) return; // Already frozen.
+
+    size_t constantsSize = sizeof(Value) * chunk->constants.count;
+    size_t codeSize = alignUp(constantsSize + chunk->count, sizeof(int)) - constantsSize; // Pad so lines stay aligned.
+    size_t linesSize = sizeof(int) * chunk->count;
+    size_t size = alignUp(constantsSize + codeSize + linesSize, CHUNK_ALIGNMENT);
+    if (size == 0) size = CHUNK_ALIGNMENT;
+
+    void* allocation;
+    if (posix_memalign(&allocation, CHUNK_ALIGNMENT, size) != 0) exit(1); // Fatal, as in `reallocate`.
+    uint8_t* block = allocation;
+
+    Value* constants = (Value*)block;
+    uint8_t* code = block + constantsSize;
+    int* lines = (int*)(code + codeSize);
+    if (constantsSize > 0) memcpy(constants, chunk->constants.values, constantsSize);
+    moveCode(chunk, code, lines); // Copy the code, releasing each segment as it goes.
+
+    size_t count = chunk->count;
+    int constantCount = chunk->constants.count;
+    freeChunk(chunk); // Release the constants array; this also resets the chunk.
+
+    chunk->count = count;
+    chunk->capacity = count;
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->constants.count = constantCount;
+    chunk->constants.capacity = constantCount;
+    chunk->constants.values = constants;
+    chunk->frozen = block;
 }
\ No newline at end of file
@@ -11,6 +11,14 @@
 // These opcodes are used to identify the operations to be performed during execution.
 typedef enum {
     OP_CONSTANT, // Push a constant value onto the stack.
+    OP_ZERO,     // Push 0 without touching the constant pool.
+    OP_ONE,      // Push 1 without touching the constant pool.
+    OP_BYTE,     // Push the unsigned integer held in the next byte.
+    OP_SHORT,    // Push the signed 16-bit integer held in the next two bytes (big-endian).
+    OP_FIXED,    // Push the next two bytes read as a signed 8.8 fixed-point number.
+    OP_GET_PARAM, // Push the parameter whose index is held in the next byte.
+    OP_GET_LOCAL, // Push the stack slot whose index is held in the next byte.
+    OP_SET_LOCAL, // Copy the top of the stack into the slot whose index is held in the next byte, without popping it.
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -22,13 +30,25 @@ typedef enum {
 // Structure representing a "Chunk" of bytecode, which is a sequence of instructions (opcodes) and their associated metadata.
 // This structure is used to store and manage the bytecode for a function or script in the virtual machine.
 typedef struct {
-    int count;           // The number of bytes currently stored in the `code` array.
-    int capacity;        // The total capacity of the `code` array, dynamically resized as needed.
-    uint8_t* code;       // Pointer to the array of bytecode instructions.
-    int* lines;          // Pointer to the array of line numbers, corresponding to each instruction in `code`.
-    ValueArray constants; // Array of constants used in the chunk, such as numbers or strings.
+    size_t count;           // The number of bytes of code written to the chunk.
+    size_t capacity;        // The number of bytes the allocated segments, or the flattened arrays, can hold.
+    uint8_t* code;          // Contiguous bytecode once the chunk is flattened or frozen; NULL while it is being written.
+    int* lines;             // Line numbers corresponding to each byte in `code`, under the same rule.
+    uint8_t** codeSegments; // Bytecode as it is written, in `CHUNK_SEGMENT_SIZE` pieces; only a lone first piece may be smaller.
+    int** lineSegments;     // Line numbers as they are written, in pieces matching `codeSegments`.
+    size_t segmentCount;    // The number of pieces allocated.
+    size_t segmentCapacity; // The length of the `codeSegments` and `lineSegments` pointer arrays.
+    ValueArray constants;   // Array of constants used in the chunk, such as numbers or strings.
+    uint8_t* frozen;        // Single block holding constants, code and lines once frozen; NULL while the chunk is writable.
 } Chunk;
 
+// Alignment of the block allocated by `freezeChunk`, matching a typical cache line.
+#define CHUNK_ALIGNMENT 64
+
+// Bytes of code per segment. A chunk grows by adding segments instead of reallocating and copying everything
+// written so far. The first segment doubles up to this size, so small chunks stay small.
+#define CHUNK_SEGMENT_SIZE (1 << 16)
+
 // Initializes a `Chunk` structure, preparing it for use by setting initial values and allocating resources as necessary.
 // This function ensures the chunk is in a consistent and ready state for further operations.
 void initChunk(Chunk* chunk);
@@ -38,11 +58,25 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 
 // Appends a single byte (instruction) and its associated line number to a `Chunk`.
-// This function dynamically resizes the storage as needed and updates the metadata.
+// This function adds storage as needed and updates the metadata.
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
+// Makes `code` and `lines` point at contiguous arrays so the chunk can be run or disassembled. A chunk that fits in
+// one segment is used in place; a larger one is copied into exactly sized arrays, releasing each segment once copied.
+// Nothing may be written to the chunk afterwards until it is reset.
+void flattenChunk(Chunk* chunk);
+
 // Adds a constant value to the chunk's constants array and returns its index.
 // This function enables efficient storage and reuse of constant values during execution.
 int addConstant(Chunk* chunk, Value value);
 
+// Empties a `Chunk` for reuse while keeping its segments allocated, so compiling into it again does not allocate
+// until it outgrows them. A frozen chunk, or one flattened out of several segments, is freed instead.
+void resetChunk(Chunk* chunk);
+
+// Packs the constants, code and line numbers of a finished chunk into one exactly sized, cache-line-aligned block
+// and releases the growable storage, freeing each code segment as soon as it has been copied. A frozen chunk must not be written to again (asserted in `writeChunk` and `addConstant`); since nothing mutates it,
+// it can be shared between threads. Its fields keep their meaning, so the VM and disassembler read it unchanged.
+void freezeChunk(Chunk* chunk);
+
 #endif // End of include guard
\ No newline at end of file
@@ -1,8 +1,13 @@
+#include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "ir.h"
+#include "memory.h"
 #include "scanner.h"
 
 typedef struct {
@@ -34,27 +39,92 @@ typedef struct {
       Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Chunk* compilingChunk;
+typedef struct {
+      int node;
+      bool expanded;
+} LowerFrame;
+
+typedef enum {
+      FRAME_PRECEDENCE,
+      FRAME_UNARY,
+      FRAME_GROUPING,
+      FRAME_BINARY,
+} ParseFrameType;
+
+// One pending call of the recursive parser, kept on the heap by parseIterative().
+typedef struct {
+      ParseFrameType type;
+      Precedence precedence;
+      TokenType operatorType;
+      int left;
+} ParseFrame;
+
+// Per thread, so batch workers can compile side by side.
+_Thread_local Parser parser;
+_Thread_local Chunk* compilingChunk;
+_Thread_local ExprArray expressions; // Kept between compilations so its nodes are reused; see freeCompiler().
+bool optimizeExpressions = false;
+bool iterativeParsing = false;
+
+// The names compilePrepared() binds to parameters, by index. None outside it.
+static _Thread_local const char** parameterNames;
+static _Thread_local int parameterCount;
+
+// Where compile errors go; NULL means stderr. See captureDiagnostics().
+static _Thread_local Diagnostics* diagnostics;
+
+// How full the VM stack is after the code emitted so far, and the most it has been. Only tracked
+// without -O, when code is emitted while parsing.
+static _Thread_local size_t stackDepth;
+static _Thread_local size_t maxStackDepth;
 
 static Chunk* currentChunk() {
       return compilingChunk;
 }
 
+// Writes part of a compile error to stderr, or appends it to the captured diagnostics.
+static void report(const char* format, ...) {
+      va_list args;
+      va_start(args, format);
+      if (diagnostics == NULL) {
+            vfprintf(stderr, format, args);
+            va_end(args);
+            return;
+      }
+
+      va_list measure;
+      va_copy(measure, args);
+      int length = vsnprintf(NULL, 0, format, measure);
+      va_end(measure);
+      if (length > 0) {
+            int needed = diagnostics->length + length + 1;
+            if (diagnostics->capacity < needed) {
+                  int oldCapacity = diagnostics->capacity;
+                  int capacity = GROW_CAPACITY(oldCapacity);
+                  while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+                  diagnostics->text = GROW_ARRAY(char, diagnostics->text, oldCapacity, capacity);
+                  diagnostics->capacity = capacity;
+            }
+            vsnprintf(diagnostics->text + diagnostics->length, length + 1, format, args);
+            diagnostics->length += length;
+      }
+      va_end(args);
+}
+
 static void errorAt(Token* token, const char* message) {
       if (parser.panicMode) return;
       parser.panicMode = true;
-      fprintf(stderr, "[line %d] Error", token->line);
+      report("[line %d] Error", token->line);
 
       if(token->type == TOKEN_EOF){
-            fprintf(stderr, " at end");
+            report(" at end");
       } else if (token->type == TOKEN_ERROR) {
 
       } else {
-            fprintf(stderr, " at '%.*s", token->length, token->start);
+            report(" at '%.*s", token->length, token->start);
       }
 
-      fprintf(stderr, ": %s\n", message);
+      report(": %s\n", message);
       parser.hadError = true;
 }
 
@@ -86,13 +156,12 @@ static void consume(TokenType type, const char* message) {
       errorAtCurrent(message);
 }
 
-static void emitByte(uint8_t byte) {
-      writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByteAt(uint8_t byte, int line) {
+      writeChunk(currentChunk(), byte, line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-      emitByte(byte1);
-      emitByte(byte2);
+static void emitByte(uint8_t byte) {
+      emitByteAt(byte, parser.previous.line);
 }
 
 static void emitReturn(){
@@ -100,6 +169,13 @@ static void emitReturn(){
 }
 
 static uint8_t makeConstant(Value value) {
+      if (optimizeExpressions) {
+            ValueArray* constants = &currentChunk()->constants;
+            for (int i = 0; i < constants->count; i++) {
+                  if (memcmp(&constants->values[i], &value, sizeof(Value)) == 0) return (uint8_t)i;
+            }
+      }
+
       int constant = addConstant(currentChunk(), value);
       if(constant > UINT8_MAX){
             error("Too many constants in one chunk.");
@@ -109,11 +185,193 @@ static uint8_t makeConstant(Value value) {
       return (uint8_t)constant;
 }
 
-static void emitConstant(Value value) {
-      emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitShort(uint8_t instruction, int operand, int line) {
+      emitByteAt(instruction, line);
+      emitByteAt((uint8_t)((operand >> 8) & 0xff), line);
+      emitByteAt((uint8_t)(operand & 0xff), line);
+}
+
+// Small integers and short fixed-point values are encoded in the instruction itself whenever the
+// VM's conversion back to a double gives exactly `value`; anything else goes to the constant pool.
+static void emitConstant(Value value, int line) {
+      double scaled = value * 256.0;
+      if (value == 0 && !signbit(value)) {
+            emitByteAt(OP_ZERO, line);
+      } else if (value == 1) {
+            emitByteAt(OP_ONE, line);
+      } else if (value >= 0 && value <= UINT8_MAX && value == (int)value && !signbit(value)) {
+            emitByteAt(OP_BYTE, line);
+            emitByteAt((uint8_t)value, line);
+      } else if (value >= INT16_MIN && value <= INT16_MAX && value == (int)value && value != 0) {
+            emitShort(OP_SHORT, (int)value, line);
+      } else if (scaled >= INT16_MIN && scaled <= INT16_MAX && scaled == (int)scaled && scaled != 0) {
+            emitShort(OP_FIXED, (int)scaled, line);
+      } else {
+            emitByteAt(OP_CONSTANT, line);
+            emitByteAt(makeConstant(value), line);
+      }
+}
+
+static void emitNode(Expr* node) {
+      switch (node->type) {
+            case EXPR_NUMBER:   emitConstant(node->as.number, node->line); break;
+            case EXPR_PARAM:
+                  emitByteAt(OP_GET_PARAM, node->line);
+                  emitByteAt((uint8_t)node->as.param, node->line);
+                  break;
+            case EXPR_NEGATE:   emitByteAt(OP_NEGATE, node->line); break;
+            case EXPR_ADD:      emitByteAt(OP_ADD, node->line); break;
+            case EXPR_SUBTRACT: emitByteAt(OP_SUBTRACT, node->line); break;
+            case EXPR_MULTIPLY: emitByteAt(OP_MULTIPLY, node->line); break;
+            case EXPR_DIVIDE:   emitByteAt(OP_DIVIDE, node->line); break;
+      }
+}
+
+static bool isLeaf(Expr* node) {
+      return node->type == EXPR_NUMBER || node->type == EXPR_PARAM;
+}
+
+// Takes the next node from the parser. Only -O needs the whole tree. Without it, nodes arrive in
+// postfix order, which is the order their code runs in, so each one is emitted right away. Then
+// memory grows with the bytecode alone, and the stack depth is all that has to be remembered.
+static void addExpression(Expr expr) {
+      if (parser.hadError) return;
+
+      if (optimizeExpressions) {
+            if (addExpr(&expressions, expr) < 0) error("Expression too large to optimize.");
+            return;
+      }
+
+      emitNode(&expr);
+      if (isLeaf(&expr)) {
+            if (++stackDepth > maxStackDepth) maxStackDepth = stackDepth;
+      } else if (expr.type != EXPR_NEGATE) {
+            stackDepth--; // Binary operators pop two operands and push one result.
+      }
+}
+
+static void addNode(ExprType type, int left, int right) {
+      Expr expr;
+      expr.type = type;
+      expr.line = parser.previous.line;
+      expr.as.operands.left = left;
+      expr.as.operands.right = right;
+      addExpression(expr);
+}
+
+// Gives up to `limit` operator nodes that -O left with more than one user a stack slot, numbering them
+// from 0, and marks every other node with -1. Users are counted walking down from the root, which visits
+// every user of a node before the node itself. Returns the number of slots; shared nodes past the limit
+// are recomputed at each use.
+static int assignSlots(int root, int* slots, int limit) {
+      for (int i = 0; i < root; i++) slots[i] = 0;
+      slots[root] = 1;
+      for (int i = root; i >= 0; i--) {
+            Expr* node = &expressions.nodes[i];
+            if (slots[i] == 0 || isLeaf(node)) continue;
+            slots[node->as.operands.left]++;
+            if (node->type != EXPR_NEGATE) slots[node->as.operands.right]++;
+      }
+
+      int count = 0;
+      for (int i = 0; i <= root; i++) {
+            bool shared = slots[i] > 1 && !isLeaf(&expressions.nodes[i]) && count < limit;
+            slots[i] = shared ? count++ : -1;
+      }
+      return count;
+}
+
+// Walks the tree rooted at `root` in post-order, emitting it when `emit` is set, and returns the
+// highest the code fills the VM stack, counting the `reserved` slots below it. The walk keeps its own
+// stack on the heap so that deeply nested expressions cannot overflow the C stack. A node with a slot
+// is computed the first time it is reached, copied into its slot at the bottom of the VM stack, and
+// reloaded from there every later time; slot numbers become -2 - slot once the node has been reached.
+static int walkExpression(int root, int* slots, int reserved, bool emit) {
+      int count = 0;
+      int capacity = 0;
+      LowerFrame* frames = NULL;
+      int depth = reserved;
+      int maxDepth = reserved;
+
+      for (LowerFrame frame = {root, false};;) {
+            if (capacity < count + 2) {
+                  int oldCapacity = capacity;
+                  capacity = GROW_CAPACITY(oldCapacity);
+                  frames = GROW_ARRAY(LowerFrame, frames, oldCapacity, capacity);
+            }
+
+            Expr* node = &expressions.nodes[frame.node];
+            int slot = slots[frame.node];
+            if (slot <= -2 || isLeaf(node) || frame.expanded) {
+                  if (slot <= -2 || isLeaf(node)) {
+                        depth++;
+                        if (depth > maxDepth) maxDepth = depth;
+                  } else if (node->type != EXPR_NEGATE) {
+                        depth--; // Binary operators pop two operands and push one result.
+                  }
+
+                  if (slot <= -2) {
+                        if (emit) {
+                              emitByteAt(OP_GET_LOCAL, node->line);
+                              emitByteAt((uint8_t)(-2 - slot), node->line);
+                        }
+                  } else {
+                        if (emit) emitNode(node);
+                        if (slot >= 0) {
+                              if (emit) {
+                                    emitByteAt(OP_SET_LOCAL, node->line);
+                                    emitByteAt((uint8_t)slot, node->line);
+                              }
+                              slots[frame.node] = -2 - slot;
+                        }
+                  }
+                  if (count == 0) break;
+                  frame = frames[--count];
+                  continue;
+            }
+
+            frame.expanded = true;
+            frames[count++] = frame;
+            if (node->type != EXPR_NEGATE) {
+                  frames[count++] = (LowerFrame){node->as.operands.right, false};
+            }
+            frame = (LowerFrame){node->as.operands.left, false};
+      }
+
+      FREE_ARRAY(LowerFrame, frames, capacity);
+      return maxDepth;
+}
+
+// Emits the optimized tree rooted at `root`. The VM never checks for stack overflow, so code that
+// would fill the stack past STACK_MAX is rejected. Shared nodes give up their slots, recomputing
+// instead, until the slots and the evaluation above them fit; a tree that fits without -O then
+// always fits with it, because the optimizer never makes the tree deeper.
+static void lowerExpression(int root) {
+      int* slots = GROW_ARRAY(int, NULL, 0, root + 1);
+      int limit = STACK_MAX;
+      int slotCount;
+      for (;;) {
+            slotCount = assignSlots(root, slots, limit);
+            int depth = walkExpression(root, slots, slotCount, false);
+            if (depth <= STACK_MAX || slotCount == 0) break;
+            limit = slotCount - (depth - STACK_MAX);
+            if (limit < 0) limit = 0;
+      }
+      slotCount = assignSlots(root, slots, limit); // The trial walk marked the slots as filled.
+      for (int i = 0; i < slotCount; i++) emitByteAt(OP_ZERO, expressions.nodes[root].line);
+
+      int maxDepth = walkExpression(root, slots, slotCount, true);
+      FREE_ARRAY(int, slots, root + 1);
+      if (maxDepth > STACK_MAX) error("Expression too deeply nested.");
 }
 
 static void endCompiler() {
+      if (!parser.hadError && optimizeExpressions && expressions.count > 0) {
+            optimizeExprArray(&expressions);
+            lowerExpression(expressions.count - 1);
+      } else if (!parser.hadError && maxStackDepth > STACK_MAX) {
+            error("Expression too deeply nested.");
+      }
       emitReturn();
 }
 
@@ -124,30 +382,47 @@ static void parsePrecedence(Precedence precedence);
 static void binary() {
       TokenType operatorType = parser.previous.type;
       ParseRule* rule = getRule(operatorType);
+      int left = expressions.count - 1;
       parsePrecedence((Precedence)(rule->precedence + 1));
+      int right = expressions.count - 1;
 
       switch (operatorType) {
-            case TOKEN_PLUS:  emitByte(OP_ADD); break;
-            case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-            case TOKEN_STAR:  emitByte(OP_MULTIPLY); break;
-            case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+            case TOKEN_PLUS:  addNode(EXPR_ADD, left, right); break;
+            case TOKEN_MINUS: addNode(EXPR_SUBTRACT, left, right); break;
+            case TOKEN_STAR:  addNode(EXPR_MULTIPLY, left, right); break;
+            case TOKEN_SLASH: addNode(EXPR_DIVIDE, left, right); break;
             default: return;
       }
 }
 
-static void grouping() {
-      expression();
-      consume(TOKEN_RIGHT_PAREN, "Excpect ')' after expression.");
-}
-
 static void grouping() {
       expression();
       consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 static void number() {
-      double value = strtod(parser.previous.start, NULL);
-      emitConstant(value);
+      Expr expr;
+      expr.type = EXPR_NUMBER;
+      expr.line = parser.previous.line;
+      expr.as.number = strtod(parser.previous.start, NULL);
+      addExpression(expr);
+}
+
+static void parameter() {
+      Token* name = &parser.previous;
+      for (int i = 0; i < parameterCount; i++) {
+            if ((int)strlen(parameterNames[i]) == name->length &&
+                  memcmp(parameterNames[i], name->start, name->length) == 0) {
+                  Expr expr;
+                  expr.type = EXPR_PARAM;
+                  expr.line = name->line;
+                  expr.as.param = i;
+                  addExpression(expr);
+                  return;
+            }
+      }
+
+      error("Unknown parameter.");
 }
 
 static void unary() {
@@ -156,19 +431,11 @@ static void unary() {
       parsePrecedence(PREC_UNARY);
 
       switch (operatorType) {
-            case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+            case TOKEN_MINUS: addNode(EXPR_NEGATE, expressions.count - 1, -1); break;
             default: return;
       }
 }
 
-static void parsePrecedence(Precedence precedence) {
-
-}
-
-static ParseRule* getRule(TokenType type) {
-      return &rules[type];
-}
-
 ParseRule rules[] = {
       [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
       [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
@@ -189,7 +456,7 @@ ParseRule rules[] = {
       [TOKEN_GREATER_EQUAL] = {NULL,     NULL,   PREC_NONE},
       [TOKEN_LESS]          = {NULL,     NULL,   PREC_NONE},
       [TOKEN_LESS_EQUAL]    = {NULL,     NULL,   PREC_NONE},
-      [TOKEN_IDENTIFIER]    = {NULL,     NULL,   PREC_NONE},
+      [TOKEN_IDENTIFIER]    = {parameter, NULL,  PREC_NONE},
       [TOKEN_STRING]        = {NULL,     NULL,   PREC_NONE},
       [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
       [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
@@ -212,20 +479,192 @@ ParseRule rules[] = {
       [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
+static void parsePrecedence(Precedence precedence) {
+      // Report a missing operand before advance() scans the next token, which on a stream may block.
+      if (getRule(parser.current.type)->prefix == NULL) {
+            errorAtCurrent("Expect expression.");
+            advance();
+            return;
+      }
+
+      advance();
+      ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+
+      prefixRule();
+
+      while (precedence <= getRule(parser.current.type)->precedence) {
+            advance();
+            ParseFn infixRule = getRule(parser.previous.type)->infix;
+            infixRule();
+      }
+}
+
+static ParseRule* getRule(TokenType type) {
+      return &rules[type];
+}
+
 static void expression() {
       parsePrecedence(PREC_ASSIGNMENT);
 }
 
-bool compile(const char* source, Chunk* chunk){
-      initScanner(source);
+static void pushParseFrame(ParseFrame** frames, size_t* count, size_t* capacity, ParseFrame frame) {
+      if (*capacity < *count + 1) {
+            size_t oldCapacity = *capacity;
+            *capacity = GROW_CAPACITY(oldCapacity);
+            *frames = GROW_ARRAY(ParseFrame, *frames, oldCapacity, *capacity);
+      }
+      (*frames)[(*count)++] = frame;
+}
+
+// Does the same work as expression(), in the same order, so it builds the same IR and reports
+// the same errors. Each recursive call of parsePrecedence(), unary(), grouping() and binary()
+// becomes a frame on a heap stack, so nesting depth is bounded by memory rather than the C stack.
+static void parseIterative() {
+      // Sized for nesting as deep as a multi-gigabyte source can go.
+      size_t count = 0;
+      size_t capacity = 0;
+      ParseFrame* frames = NULL;
+      enum { BEGIN, CONTINUE, FINISH } state = BEGIN;
+
+      pushParseFrame(&frames, &count, &capacity, (ParseFrame){.type = FRAME_PRECEDENCE, .precedence = PREC_ASSIGNMENT});
+      while (count > 0) {
+            switch (state) {
+                  case BEGIN: {
+                        if (getRule(parser.current.type)->prefix == NULL) {
+                              errorAtCurrent("Expect expression.");
+                              advance();
+                              count--;
+                              state = FINISH;
+                              break;
+                        }
+
+                        advance();
+                        ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+                        if (prefixRule == unary) {
+                              pushParseFrame(&frames, &count, &capacity,
+                                             (ParseFrame){.type = FRAME_UNARY, .operatorType = parser.previous.type});
+                              pushParseFrame(&frames, &count, &capacity,
+                                             (ParseFrame){.type = FRAME_PRECEDENCE, .precedence = PREC_UNARY});
+                        } else if (prefixRule == grouping) {
+                              pushParseFrame(&frames, &count, &capacity, (ParseFrame){.type = FRAME_GROUPING});
+                              pushParseFrame(&frames, &count, &capacity,
+                                             (ParseFrame){.type = FRAME_PRECEDENCE, .precedence = PREC_ASSIGNMENT});
+                        } else {
+                              prefixRule();
+                              state = CONTINUE;
+                        }
+                        break;
+                  }
+
+                  case CONTINUE: {
+                        ParseFrame* frame = &frames[count - 1];
+                        if (frame->precedence > getRule(parser.current.type)->precedence) {
+                              count--;
+                              state = FINISH;
+                              break;
+                        }
+
+                        advance();
+                        ParseFn infixRule = getRule(parser.previous.type)->infix;
+                        if (infixRule == binary) {
+                              TokenType operatorType = parser.previous.type;
+                              pushParseFrame(&frames, &count, &capacity,
+                                             (ParseFrame){.type = FRAME_BINARY, .operatorType = operatorType,
+                                                          .left = expressions.count - 1});
+                              pushParseFrame(&frames, &count, &capacity,
+                                             (ParseFrame){.type = FRAME_PRECEDENCE,
+                                                          .precedence = (Precedence)(getRule(operatorType)->precedence + 1)});
+                              state = BEGIN;
+                        } else {
+                              infixRule();
+                        }
+                        break;
+                  }
+
+                  case FINISH: {
+                        ParseFrame frame = frames[--count];
+                        switch (frame.type) {
+                              case FRAME_UNARY:
+                                    if (frame.operatorType == TOKEN_MINUS) {
+                                          addNode(EXPR_NEGATE, expressions.count - 1, -1);
+                                    }
+                                    break;
+                              case FRAME_GROUPING:
+                                    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+                                    break;
+                              case FRAME_BINARY: {
+                                    int right = expressions.count - 1;
+                                    switch (frame.operatorType) {
+                                          case TOKEN_PLUS:  addNode(EXPR_ADD, frame.left, right); break;
+                                          case TOKEN_MINUS: addNode(EXPR_SUBTRACT, frame.left, right); break;
+                                          case TOKEN_STAR:  addNode(EXPR_MULTIPLY, frame.left, right); break;
+                                          case TOKEN_SLASH: addNode(EXPR_DIVIDE, frame.left, right); break;
+                                          default: break;
+                                    }
+                                    break;
+                              }
+                              case FRAME_PRECEDENCE:
+                                    break;
+                        }
+                        state = CONTINUE;
+                        break;
+                  }
+            }
+      }
+
+      FREE_ARRAY(ParseFrame, frames, capacity);
+}
+
+static bool compileTokens(Chunk* chunk){
       compilingChunk = chunk;
+      expressions.count = 0;
+      stackDepth = 0;
+      maxStackDepth = 0;
 
       parser.hadError = false;
       parser.panicMode = false;
 
       advance();
-      expression();
+      if (iterativeParsing) {
+            parseIterative();
+      } else {
+            expression();
+      }
       consume(TOKEN_EOF, "Excpect end of expression.");
       endCompiler();
       return !parser.hadError;
+}
+
+bool compilePrepared(const char* source, const char* names[], int count, Chunk* chunk){
+      if (count > UINT8_MAX + 1) {
+            report("Too many parameters.\n");
+            return false;
+      }
+
+      parameterNames = names;
+      parameterCount = count;
+      bool compiled = compile(source, chunk);
+      parameterNames = NULL;
+      parameterCount = 0;
+      return compiled;
+}
+
+void freeCompiler(){
+      freeExprArray(&expressions);
+}
+
+void captureDiagnostics(Diagnostics* target){
+      diagnostics = target;
+}
+
+bool compile(const char* source, Chunk* chunk){
+      initScanner(source);
+      return compileTokens(chunk);
+}
+
+bool compileStream(FILE* input, Chunk* chunk){
+      initStreamScanner(input, SCANNER_WINDOW_SIZE);
+      bool compiled = compileTokens(chunk);
+      freeScanner();
+      return compiled;
 }
\ No newline at end of file
@@ -1,8 +1,36 @@
 #ifndef clox_compiler_h
 #define clox_compiler_h
 
+#include <stdio.h>
+
 #include "vm.h"
 
+// Set by the -O flag: run the IR optimization passes before lowering to bytecode.
+extern bool optimizeExpressions;
+// Set by --iterative-parser: parse with an explicit heap stack instead of recursion, for deeply nested input.
+extern bool iterativeParsing;
+
 bool compile(const char* source, Chunk* chunk);
+// Compiles while reading `input`, holding only a bounded window of the source in memory. Without -O,
+// code is emitted as the expression is parsed, so memory grows with the bytecode and the parser's
+// nesting alone. With -O the IR of the whole expression, 24 bytes a node, is built first and is
+// limited to EXPR_MAX (ir.h) nodes. A read error fails the compilation rather than ending the input early.
+bool compileStream(FILE* input, Chunk* chunk);
+// Compiles `source` with each name in `names` standing for the parameter at the same index. Any other
+// identifier is a compile error, as it is for compile().
+bool compilePrepared(const char* source, const char* names[], int count, Chunk* chunk);
+// Releases the memory the calling thread's compiler keeps between compilations.
+void freeCompiler();
+
+// Compile errors held in memory as the text that would have gone to stderr.
+typedef struct {
+    char* text;
+    int length;
+    int capacity;
+} Diagnostics;
+
+// Appends the calling thread's compile errors to `diagnostics` instead of printing them, or prints
+// them to stderr again when `diagnostics` is NULL. The caller owns the buffer and resets `length`.
+void captureDiagnostics(Diagnostics* diagnostics);
 
 #endif
\ No newline at end of file
@@ -11,7 +11,7 @@
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name); // Print a header with the name of the chunk.
 
-  for (int offset = 0; offset < chunk->count;) { // Iterate through all instructions in the chunk.
+  for (size_t offset = 0; offset < chunk->count;) { // Iterate through all instructions in the chunk.
     offset = disassembleInstruction(chunk, offset); // Disassemble and print each instruction.
   }
 }
@@ -19,7 +19,7 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 // Handles the disassembly of instructions that involve constants.
 // Prints the instruction name, the constant index, and the constant's value.
 // This function is used for opcodes like `OP_CONSTANT` that require constant values.
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
+static size_t constantInstruction(const char* name, Chunk* chunk, size_t offset) {
     uint8_t constant = chunk->code[offset + 1]; // Read the constant index from the bytecode.
     printf("%-16s %4d '", name, constant);      // Print the instruction name and constant index.
     printValue(chunk->constants.values[constant]); // Print the constant's value.
@@ -27,10 +27,37 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2; // Return the next instruction's offset (skip the constant index).
 }
 
+// Handles the disassembly of instructions that carry a number directly in the bytecode.
+// Prints the instruction name and the value the VM will push.
+// This function is used for opcodes like `OP_BYTE`, `OP_SHORT` and `OP_FIXED`.
+static size_t immediateInstruction(const char* name, Chunk* chunk, size_t offset) {
+  uint8_t instruction = chunk->code[offset];
+  Value value;
+  if (instruction == OP_BYTE) {
+    value = chunk->code[offset + 1];
+  } else {
+    int16_t operand = (int16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    value = instruction == OP_FIXED ? operand * (1.0 / 256) : operand;
+  }
+
+  printf("%-16s      '", name); // Line up the value with the constant column of `OP_CONSTANT`.
+  printValue(value);
+  printf("\n");
+  return offset + (instruction == OP_BYTE ? 2 : 3); // Skip the opcode and its one- or two-byte operand.
+}
+
+// Handles the disassembly of instructions with a one-byte slot operand.
+// Prints the instruction name and the slot.
+// This function is used for opcodes like `OP_GET_PARAM` and `OP_GET_LOCAL`.
+static size_t byteInstruction(const char* name, Chunk* chunk, size_t offset) {
+  printf("%-16s %4d\n", name, chunk->code[offset + 1]);
+  return offset + 2; // Skip the opcode and its operand.
+}
+
 // Handles the disassembly of simple instructions that do not involve additional data.
 // Prints the instruction name.
 // This function is used for opcodes like `OP_RETURN`.
-static int simpleInstruction(const char* name, int offset) {
+static size_t simpleInstruction(const char* name, size_t offset) {
   printf("%s\n", name); // Print the instruction name.
   return offset + 1;    // Return the next instruction's offset.
 }
@@ -38,8 +65,8 @@ static int simpleInstruction(const char* name, int offset) {
 // Disassembles a single instruction at the given offset in the `Chunk` and prints it.
 // This function identifies the opcode and calls the appropriate handler function.
 // It is the core function for interpreting the bytecode for debugging purposes.
-int disassembleInstruction(Chunk* chunk, int offset) {
-  printf("%04d ", offset); // Print the instruction's offset in the chunk.
+size_t disassembleInstruction(Chunk* chunk, size_t offset) {
+  printf("%04zu ", offset); // Print the instruction's offset in the chunk.
 
   // Print the line number, or a pipe if it is the same as the previous instruction.
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -53,6 +80,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_CONSTANT:
         // Handle the `OP_CONSTANT` instruction, which involves a constant value.
         return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_ZERO:
+      return simpleInstruction("OP_ZERO", offset);
+    case OP_ONE:
+      return simpleInstruction("OP_ONE", offset);
+    case OP_BYTE:
+      return immediateInstruction("OP_BYTE", chunk, offset);
+    case OP_SHORT:
+      return immediateInstruction("OP_SHORT", chunk, offset);
+    case OP_FIXED:
+      return immediateInstruction("OP_FIXED", chunk, offset);
+    case OP_GET_PARAM:
+      return byteInstruction("OP_GET_PARAM", chunk, offset);
+    case OP_GET_LOCAL:
+      return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL:
+      return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_ADD:
       return simpleInstruction("OP_ADD", offset);
     case OP_SUBTRACT:
@@ -71,4 +114,44 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         printf("Unknown opcode %d\n", instruction);
         return offset + 1; // Skip the unknown instruction.
   }
-}
\ No newline at end of file
+}
+
+// Returns the printable name of an opcode, or NULL if it is not one.
+// This function is used by the profiler to label samples without disassembling the whole chunk.
+const char* opcodeName(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT: return "OP_CONSTANT";
+    case OP_ZERO:     return "OP_ZERO";
+    case OP_ONE:      return "OP_ONE";
+    case OP_BYTE:     return "OP_BYTE";
+    case OP_SHORT:    return "OP_SHORT";
+    case OP_FIXED:    return "OP_FIXED";
+    case OP_GET_PARAM: return "OP_GET_PARAM";
+    case OP_GET_LOCAL: return "OP_GET_LOCAL";
+    case OP_SET_LOCAL: return "OP_SET_LOCAL";
+    case OP_ADD:      return "OP_ADD";
+    case OP_SUBTRACT: return "OP_SUBTRACT";
+    case OP_MULTIPLY: return "OP_MULTIPLY";
+    case OP_DIVIDE:   return "OP_DIVIDE";
+    case OP_NEGATE:   return "OP_NEGATE";
+    case OP_RETURN:   return "OP_RETURN";
+    default:          return NULL;
+  }
+}
+
+// Returns the number of bytes an instruction occupies, counting the opcode and its operands.
+int instructionLength(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_BYTE:
+    case OP_GET_PARAM:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      return 2; // One-byte operand.
+    case OP_SHORT:
+    case OP_FIXED:
+      return 3; // Two-byte operand.
+    default:
+      return 1;
+  }
+}
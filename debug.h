@@ -4,6 +4,8 @@
 #include "chunk.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+size_t disassembleInstruction(Chunk* chunk, size_t offset);
+const char* opcodeName(uint8_t instruction);
+int instructionLength(uint8_t instruction);
 
 #endif
\ No newline at end of file
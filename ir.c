@@ -0,0 +1,251 @@
+#include <math.h>
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+
+void initExprArray(ExprArray* array) {
+      array->count = 0;
+      array->capacity = 0;
+      array->nodes = NULL;
+}
+
+void freeExprArray(ExprArray* array) {
+      FREE_ARRAY(Expr, array->nodes, array->capacity);
+      initExprArray(array);
+}
+
+int addExpr(ExprArray* array, Expr expr) {
+      if (array->count == EXPR_MAX) return -1;
+      if (array->capacity < array->count + 1) {
+            int oldCapacity = array->capacity;
+            array->capacity = GROW_CAPACITY(oldCapacity);
+            array->nodes = GROW_ARRAY(Expr, array->nodes, oldCapacity, array->capacity);
+      }
+
+      array->nodes[array->count] = expr;
+      return array->count++;
+}
+
+// Compares bit patterns, so 0 and -0 are different numbers here.
+static bool isNumber(Expr* expr, double value) {
+      return expr->type == EXPR_NUMBER &&
+             memcmp(&expr->as.number, &value, sizeof(double)) == 0;
+}
+
+// x / d and x * (1 / d) round identically only when 1 / d is exact, i.e. d is a power of two.
+static bool exactReciprocal(double divisor, double* reciprocal) {
+      int exponent;
+      if (!isfinite(divisor) || fabs(frexp(divisor, &exponent)) != 0.5) return false;
+
+      *reciprocal = 1.0 / divisor;
+      return isfinite(*reciprocal) && fabs(frexp(*reciprocal, &exponent)) == 0.5;
+}
+
+static void makeNumber(Expr* node, double value) {
+      node->type = EXPR_NUMBER;
+      node->as.number = value;
+}
+
+// Replaces node `index` with operand `from`. Only one parent ever refers to a node,
+// so the copy leaves the original unreachable rather than shared.
+static void replaceWith(ExprArray* array, int* need, int index, int from) {
+      array->nodes[index] = array->nodes[from];
+      need[index] = need[from];
+}
+
+static void optimizeNegate(ExprArray* array, int* need, int index) {
+      Expr* node = &array->nodes[index];
+      Expr* operand = &array->nodes[node->as.operands.left];
+
+      if (operand->type == EXPR_NUMBER) {
+            makeNumber(node, -operand->as.number);
+            need[index] = 1;
+      } else if (operand->type == EXPR_NEGATE) {
+            replaceWith(array, need, index, operand->as.operands.left);
+      } else {
+            need[index] = need[node->as.operands.left];
+      }
+}
+
+static void makeNegate(ExprArray* array, int* need, int index, int operand) {
+      Expr* node = &array->nodes[index];
+      node->type = EXPR_NEGATE;
+      node->as.operands.left = operand;
+      optimizeNegate(array, need, index);
+}
+
+static bool foldBinary(Expr* node, Expr* left, Expr* right) {
+      if (left->type != EXPR_NUMBER || right->type != EXPR_NUMBER) return false;
+
+      double a = left->as.number;
+      double b = right->as.number;
+      switch (node->type) {
+            case EXPR_ADD:      makeNumber(node, a + b); break;
+            case EXPR_SUBTRACT: makeNumber(node, a - b); break;
+            case EXPR_MULTIPLY: makeNumber(node, a * b); break;
+            case EXPR_DIVIDE:   makeNumber(node, a / b); break;
+            default: return false;
+      }
+      return true;
+}
+
+// Identities that hold for every double, including -0, infinities and NaN.
+// x + 0 is deliberately missing: -0 + 0 is +0.
+static bool simplifyBinary(ExprArray* array, int* need, int index) {
+      Expr* node = &array->nodes[index];
+      int left = node->as.operands.left;
+      int right = node->as.operands.right;
+      Expr* a = &array->nodes[left];
+      Expr* b = &array->nodes[right];
+      double reciprocal;
+
+      switch (node->type) {
+            case EXPR_ADD:
+                  if (isNumber(b, -0.0)) { replaceWith(array, need, index, left); return true; }
+                  if (isNumber(a, -0.0)) { replaceWith(array, need, index, right); return true; }
+                  return false;
+            case EXPR_SUBTRACT:
+                  if (isNumber(b, 0.0)) { replaceWith(array, need, index, left); return true; }
+                  return false;
+            case EXPR_MULTIPLY:
+                  if (isNumber(b, 1.0)) { replaceWith(array, need, index, left); return true; }
+                  if (isNumber(a, 1.0)) { replaceWith(array, need, index, right); return true; }
+                  if (isNumber(b, -1.0)) { makeNegate(array, need, index, left); return true; }
+                  if (isNumber(a, -1.0)) { makeNegate(array, need, index, right); return true; }
+                  return false;
+            case EXPR_DIVIDE:
+                  if (isNumber(b, 1.0)) { replaceWith(array, need, index, left); return true; }
+                  if (isNumber(b, -1.0)) { makeNegate(array, need, index, left); return true; }
+                  if (b->type == EXPR_NUMBER && exactReciprocal(b->as.number, &reciprocal)) {
+                        node->type = EXPR_MULTIPLY;
+                        b->as.number = reciprocal;
+                  }
+                  return false;
+            default:
+                  return false;
+      }
+}
+
+// Sethi-Ullman numbering: the stack slots needed to evaluate a binary node. For the
+// commutative operators, evaluating the deeper operand first keeps the stack shallower.
+static void orderOperands(ExprArray* array, int* need, int index) {
+      Expr* node = &array->nodes[index];
+      int left = node->as.operands.left;
+      int right = node->as.operands.right;
+
+      if ((node->type == EXPR_ADD || node->type == EXPR_MULTIPLY) &&
+            need[right] > need[left]) {
+            node->as.operands.left = right;
+            node->as.operands.right = left;
+            left = node->as.operands.left;
+            right = node->as.operands.right;
+      }
+
+      need[index] = need[left] == need[right] ? need[left] + 1 :
+                    need[left] > need[right] ? need[left] : need[right] + 1;
+}
+
+static bool isLeaf(Expr* expr) {
+      return expr->type == EXPR_NUMBER || expr->type == EXPR_PARAM;
+}
+
+static bool isCommutative(ExprType type) {
+      return type == EXPR_ADD || type == EXPR_MULTIPLY;
+}
+
+static uint64_t hashExpr(Expr* expr) {
+      uint64_t hash = (uint64_t)expr->type * 0x9e3779b97f4a7c15u;
+      if (expr->type == EXPR_NUMBER) {
+            uint64_t bits;
+            memcpy(&bits, &expr->as.number, sizeof(bits));
+            hash ^= bits;
+      } else if (expr->type == EXPR_PARAM) {
+            hash ^= (uint64_t)expr->as.param;
+      } else {
+            // Both operand orders of + and * hash alike, so x*y and y*x meet in the table.
+            uint64_t left = (uint64_t)expr->as.operands.left;
+            uint64_t right = expr->type == EXPR_NEGATE ? 0 : (uint64_t)expr->as.operands.right;
+            hash ^= isCommutative(expr->type) ? (left + right) * 0xff51afd7ed558ccdu ^ (left * right)
+                                              : left * 0xff51afd7ed558ccdu + right;
+      }
+      hash ^= hash >> 29;
+      return hash * 0xbf58476d1ce4e5b9u;
+}
+
+static bool sameExpr(Expr* a, Expr* b) {
+      if (a->type != b->type) return false;
+      switch (a->type) {
+            case EXPR_NUMBER: return memcmp(&a->as.number, &b->as.number, sizeof(double)) == 0;
+            case EXPR_PARAM:  return a->as.param == b->as.param;
+            case EXPR_NEGATE: return a->as.operands.left == b->as.operands.left;
+            default:
+                  if (a->as.operands.left == b->as.operands.left &&
+                        a->as.operands.right == b->as.operands.right) return true;
+                  return isCommutative(a->type) &&
+                         a->as.operands.left == b->as.operands.right &&
+                         a->as.operands.right == b->as.operands.left;
+      }
+}
+
+// Common subexpression elimination by hash-consing: every node's operands are redirected to the first
+// node that computes the same value, so repeated subexpressions such as the two x*y in x*y + x*y end up
+// as one node with several users. Afterwards the IR is a DAG rather than a tree.
+static void shareSubexpressions(ExprArray* array) {
+      int tableSize = 8;
+      while (tableSize < array->count * 2) tableSize *= 2;
+      int* table = GROW_ARRAY(int, NULL, 0, tableSize);
+      int* canonical = GROW_ARRAY(int, NULL, 0, array->count);
+      for (int i = 0; i < tableSize; i++) table[i] = -1;
+
+      for (int i = 0; i < array->count; i++) {
+            Expr* node = &array->nodes[i];
+            if (!isLeaf(node)) {
+                  node->as.operands.left = canonical[node->as.operands.left];
+                  if (node->type != EXPR_NEGATE) node->as.operands.right = canonical[node->as.operands.right];
+            }
+
+            int slot = (int)(hashExpr(node) & (uint64_t)(tableSize - 1));
+            while (table[slot] != -1 && !sameExpr(&array->nodes[table[slot]], node)) {
+                  slot = (slot + 1) & (tableSize - 1);
+            }
+            if (table[slot] == -1) table[slot] = i;
+            canonical[i] = table[slot];
+      }
+
+      FREE_ARRAY(int, canonical, array->count);
+      FREE_ARRAY(int, table, tableSize);
+}
+
+void optimizeExprArray(ExprArray* array) {
+      if (array->count == 0) return;
+      int* need = GROW_ARRAY(int, NULL, 0, array->count);
+
+      // Operands always precede their users, so one forward sweep rewrites the tree bottom-up
+      // without recursion.
+      for (int i = 0; i < array->count; i++) {
+            Expr* node = &array->nodes[i];
+            switch (node->type) {
+                  case EXPR_NUMBER:
+                  case EXPR_PARAM:
+                        need[i] = 1;
+                        break;
+                  case EXPR_NEGATE:
+                        optimizeNegate(array, need, i);
+                        break;
+                  default: {
+                        Expr* left = &array->nodes[node->as.operands.left];
+                        Expr* right = &array->nodes[node->as.operands.right];
+                        if (foldBinary(node, left, right)) {
+                              need[i] = 1;
+                        } else if (!simplifyBinary(array, need, i)) {
+                              orderOperands(array, need, i);
+                        }
+                        break;
+                  }
+            }
+      }
+
+      FREE_ARRAY(int, need, array->count);
+      shareSubexpressions(array);
+}
@@ -0,0 +1,56 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "common.h"
+#include "value.h"
+
+// Kinds of node in the expression IR built by the parser.
+typedef enum {
+      EXPR_NUMBER,
+      EXPR_PARAM,    // A prepared expression's parameter, known only when it is evaluated.
+      EXPR_NEGATE,
+      EXPR_ADD,
+      EXPR_SUBTRACT,
+      EXPR_MULTIPLY,
+      EXPR_DIVIDE,
+} ExprType;
+
+// A single IR node. Operands are indexes into the owning ExprArray rather than pointers,
+// so the whole tree lives in one flat allocation.
+typedef struct {
+      ExprType type;
+      int line;
+      union {
+            Value number;
+            int param;
+            struct {
+                  int left;
+                  int right;
+            } operands;
+      } as;
+} Expr;
+
+// Nodes are appended in postfix order: every operand has a lower index than the node using it,
+// and the root of the most recently parsed expression is always the last node. Nodes no longer
+// reachable from the root may be left behind by the optimizer.
+typedef struct {
+      int count;
+      int capacity;
+      Expr* nodes;
+} ExprArray;
+
+// The most nodes an ExprArray holds, so that every count, capacity and index the optimizer derives
+// from it, up to twice the node count, still fits in an int.
+#define EXPR_MAX (1 << 28)
+
+void initExprArray(ExprArray* array);
+void freeExprArray(ExprArray* array);
+// Appends `expr` and returns its index, or -1 without appending once the array holds EXPR_MAX nodes.
+int addExpr(ExprArray* array, Expr expr);
+
+// Rewrites the tree in place: constant folding, IEEE-safe algebraic identities,
+// strength reduction and operand reordering to reduce the stack depth needed to evaluate it.
+// Finally merges common subexpressions, after which a node may be the operand of several others.
+void optimizeExprArray(ExprArray* array);
+
+#endif
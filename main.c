@@ -1,18 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h" // Include common utilities and definitions for portability and standard functionality.
+#include "batch.h"
 #include "chunk.h"  // Include the definitions and functions for managing chunks of bytecode.
+#include "compiler.h"
 #include "debug.h"  // Include the debugging utilities for disassembling and analyzing bytecode.
+#include "memory.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "server.h"
+#include "stats.h"
 #include "vm.h"
 
+static bool reportCounts = false;
+
 static void repl(){
     char line[1024];
+    bool interactive = isatty(STDIN_FILENO);
     for(;;){
-        printf("> ");
+        // Prompts share the VM's output buffer so they stay in order with results;
+        // it is only flushed per line when someone is typing.
+        writeOutput("> ", 2);
+        if (interactive) flushOutput();
         if (!fgets(line, sizeof(line), stdin)){
-            printf("\n");
+            writeOutput("\n", 1);
             break;
         }
 
@@ -50,27 +69,320 @@ static char* readFile(const char* path){
 }
 
 static void runFile(const char* path){
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    InterpretResult result;
+    if (strcmp(path, "-") == 0){
+        // Compile standard input as it arrives instead of reading it all first.
+        result = interpretStream(stdin);
+    } else {
+        beginPhase(PHASE_READ);
+        char* source = readFile(path);
+        endPhase(PHASE_READ);
+        result = interpret(source);
+        free(source);
+    }
+    flushOutput();
+
+    writeStats(stderr, vm.codeSize, vm.instructionCount);
+    if (reportCounts) {
+        fprintf(stderr, "%zu bytes emitted, %zu instructions executed\n",
+                vm.codeSize, vm.instructionCount);
+    }
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void runFilesScheduled(const char* paths[], int count, size_t quantum){
+    const char** sources = (const char**)malloc(sizeof(char*) * count);
+    InterpretResult* results = (InterpretResult*)malloc(sizeof(InterpretResult) * count);
+    if (sources == NULL || results == NULL) {
+        fprintf(stderr, "Not enough memory to schedule %d scripts.\n", count);
+        exit(74);
+    }
+
+    for (int i = 0; i < count; i++){
+        sources[i] = readFile(paths[i]);
+    }
+
+    runScheduled(sources, count, quantum, results);
+    flushOutput();
+
+    int status = 0;
+    for (int i = 0; i < count; i++){
+        free((char*)sources[i]);
+        if (status == 0 && results[i] == INTERPRET_COMPILE_ERROR) status = 65;
+        if (status == 0 && results[i] == INTERPRET_RUNTIME_ERROR) status = 70;
+    }
+    free(sources);
+    free(results);
+
+    if (status != 0) exit(status);
+}
+
+typedef struct {
+    char** items;
+    int count;
+    int capacity;
+} PathList;
+
+static void addPath(PathList* list, char* path){
+    if (list->count == list->capacity){
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->items = GROW_ARRAY(char*, list->items, oldCapacity, list->capacity);
+    }
+    list->items[list->count++] = path;
+}
+
+static int comparePaths(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Adds `path`, or if it is a directory every regular file directly inside it, in name order.
+static void collectPaths(PathList* list, const char* path){
+    DIR* dir = opendir(path);
+    if (dir == NULL){
+        char* file = strdup(path);
+        if (file == NULL) {
+            fprintf(stderr, "Not enough memory to list scripts.\n");
+            exit(74);
+        }
+        addPath(list, file);
+        return;
+    }
+
+    int first = list->count;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL){
+        if (entry->d_name[0] == '.') continue;
+
+        size_t length = strlen(path) + strlen(entry->d_name) + 2;
+        char* file = (char*)malloc(length);
+        if (file == NULL) {
+            fprintf(stderr, "Not enough memory to list scripts.\n");
+            exit(74);
+        }
+        snprintf(file, length, "%s/%s", path, entry->d_name);
+
+        struct stat info;
+        if (stat(file, &info) == 0 && S_ISREG(info.st_mode)){
+            addPath(list, file);
+        } else {
+            free(file);
+        }
+    }
+    closedir(dir);
+    qsort(list->items + first, list->count - first, sizeof(char*), comparePaths);
+}
+
+static void runBatchFiles(const char* paths[], int count, int threads){
+    PathList list = {NULL, 0, 0};
+    for (int i = 0; i < count; i++){
+        collectPaths(&list, paths[i]);
+    }
+
+    BatchResult* results = (BatchResult*)malloc(sizeof(BatchResult) * (list.count > 0 ? list.count : 1));
+    if (results == NULL) {
+        fprintf(stderr, "Not enough memory to run %d scripts.\n", list.count);
+        exit(74);
+    }
+
+    uint64_t start = monotonicNanoseconds();
+    runBatch((const char**)list.items, list.count, threads, results);
+    double elapsed = (monotonicNanoseconds() - start) / 1e6;
+
+    // Results come out in input order, whichever worker ran each script.
+    int status = 0;
+    for (int i = 0; i < list.count; i++){
+        BatchResult* result = &results[i];
+        if (!result->readable){
+            fprintf(stderr, "Could not read file \"%s\".\n", list.items[i]);
+            if (status == 0) status = 74;
+            continue;
+        }
+
+        // Compile errors were captured per script; print them here, each line naming its file.
+        if (result->diagnostics != NULL){
+            for (const char* line = result->diagnostics; *line != '\0';){
+                const char* end = strchr(line, '\n');
+                int length = end != NULL ? (int)(end - line) : (int)strlen(line);
+                fprintf(stderr, "%s: %.*s\n", list.items[i], length, line);
+                line += length + (end != NULL);
+            }
+            free(result->diagnostics);
+        }
+
+        const char* outcome = "ok";
+        if (result->status == INTERPRET_OK){
+            char text[VALUE_TEXT_MAX + 1];
+            int length = formatValue(text, result->value, !printfCompatible);
+            text[length++] = '\n';
+            writeOutput(text, length);
+        } else if (result->status == INTERPRET_COMPILE_ERROR){
+            outcome = "compile error";
+            if (status == 0) status = 65;
+        } else {
+            outcome = "runtime error";
+            if (status == 0) status = 70;
+        }
+        fprintf(stderr, "%s: %s in %.3f ms on worker %d\n",
+                list.items[i], outcome, result->nanoseconds / 1e6, result->worker);
+    }
+    flushOutput();
+    fprintf(stderr, "%d scripts on %d threads in %.3f ms\n", list.count, threads, elapsed);
+
+    for (int i = 0; i < list.count; i++){
+        free(list.items[i]);
+    }
+    FREE_ARRAY(char*, list.items, list.capacity);
+    free(results);
+
+    if (status != 0) exit(status);
+}
+
+// Writes `source` into `buffer` with each parameter name replaced by its value, which is how callers
+// without prepared expressions build the text they pass to interpret().
+static void spliceSource(char* buffer, const char* source, const char* names[], int count, const Value* params){
+    while (*source != '\0'){
+        if (!isalpha((unsigned char)*source) && *source != '_'){
+            *buffer++ = *source++;
+            continue;
+        }
+
+        const char* start = source;
+        while (isalnum((unsigned char)*source) || *source == '_') source++;
+        int length = (int)(source - start);
+        for (int i = 0; i < count; i++){
+            if ((int)strlen(names[i]) == length && memcmp(names[i], start, length) == 0){
+                buffer += sprintf(buffer, "(%.17g)", params[i]);
+                break;
+            }
+        }
+    }
+    *buffer = '\0';
+}
+
+// Evaluates `source` `iterations` times with changing parameter values, first through a prepared chunk
+// and then by splicing the values into the text and compiling it again each time.
+static void benchmarkPrepared(long iterations, const char* source, const char* names[], int count){
+    Chunk prepared;
+    initChunk(&prepared);
+    if (prepare(source, names, count, &prepared) != INTERPRET_OK) exit(65);
+
+    Value params[UINT8_MAX + 1];
+    Value result;
+    double preparedSum = 0;
+    uint64_t start = monotonicNanoseconds();
+    for (long i = 0; i < iterations; i++){
+        for (int p = 0; p < count; p++) params[p] = i + p * 0.25;
+        evaluate(&prepared, params, &result);
+        preparedSum += result;
+    }
+    double preparedTime = (double)(monotonicNanoseconds() - start);
+    freeChunk(&prepared);
+
+    // A parameter name is at least one character and its value at most 26, so this always fits.
+    char* text = (char*)malloc(strlen(source) * 27 + 1);
+    if (text == NULL) {
+        fprintf(stderr, "Not enough memory to splice \"%s\".\n", source);
+        exit(74);
+    }
+
+    double splicedSum = 0;
+    start = monotonicNanoseconds();
+    for (long i = 0; i < iterations; i++){
+        for (int p = 0; p < count; p++) params[p] = i + p * 0.25;
+        spliceSource(text, source, names, count, params);
+        Chunk chunk;
+        initChunk(&chunk);
+        if (loadChunk(text, &chunk) != INTERPRET_OK) exit(65);
+        vm.result = &result;
+        resume(SIZE_MAX);
+        splicedSum += result;
+        freeChunk(&chunk);
+    }
+    double splicedTime = (double)(monotonicNanoseconds() - start);
+    free(text);
+
+    printf("prepared:  %.1f ns per evaluation\n", preparedTime / iterations);
+    printf("recompile: %.1f ns per evaluation\n", splicedTime / iterations);
+    printf("results %s\n", preparedSum == splicedSum ? "match" : "differ");
+}
+
 int main(int argc, const char* argv[]) {
     // Entry point of the program. Takes command-line arguments but does not use them in this example.
 
     initVM();
 
-    if (argc == 1){
+    size_t quantum = 0;
+    const char* profilePath = NULL;
+    bool batch = false;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++){
+        if (strcmp(argv[arg], "-O") == 0){
+            optimizeExpressions = true;
+        } else if (strcmp(argv[arg], "--iterative-parser") == 0){
+            iterativeParsing = true;
+        } else if (strcmp(argv[arg], "--report") == 0){
+            reportCounts = true;
+        } else if (strcmp(argv[arg], "--stats") == 0){
+            statsEnabled = true;
+        } else if (strcmp(argv[arg], "--printf-g") == 0){
+            printfCompatible = true;
+        } else if (strcmp(argv[arg], "--profile") == 0 && arg + 1 < argc){
+            profilePath = argv[++arg];
+        } else if (strcmp(argv[arg], "--batch") == 0){
+            batch = true;
+        } else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc){
+            threads = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--quantum") == 0 && arg + 1 < argc){
+            quantum = (size_t)strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc){
+            exit(serve(argv[arg + 1]));
+        } else if (strcmp(argv[arg], "--bench-prepared") == 0 && arg + 2 < argc){
+            benchmarkPrepared(atol(argv[arg + 1]), argv[arg + 2], &argv[arg + 3], argc - arg - 3);
+            exit(0);
+        } else if (strcmp(argv[arg], "--loadgen") == 0 && arg + 3 < argc){
+            exit(runLoadGenerator(argv[arg + 1], atoi(argv[arg + 2]), atoi(argv[arg + 3])));
+        } else {
+            break;
+        }
+    }
+
+    // The profiler only samples scripts run through interpret() or interpretStream(), which batch
+    // and scheduled runs bypass; say so rather than writing an empty profile.
+    if (profilePath != NULL && (batch || quantum > 0)){
+        fprintf(stderr, "--profile can't be combined with --batch or --quantum.\n");
+        exit(64);
+    }
+
+    initStats();
+    if (profilePath != NULL && !startProfiler(profilePath)){
+        fprintf(stderr, "Could not start the profiler.\n");
+        exit(74);
+    }
+
+    if (batch && arg < argc){
+        runBatchFiles(&argv[arg], argc - arg, threads);
+    } else if (quantum > 0 && arg < argc){
+        runFilesScheduled(&argv[arg], argc - arg, quantum);
+    } else if (arg == argc){
         repl();
-    } else if (argc == 2){
-        runFile(argv[1]);
+    } else if (arg == argc - 1){
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox[path]\n");
+        fprintf(stderr, "Usage: clox [-O] [--iterative-parser] [--report] [--stats] [--printf-g] [--profile <out>] [path | -]\n"
+                        "       clox --batch [-j <threads>] (path | directory)...\n"
+                        "       clox --quantum <instructions> path...\n"
+                        "       clox --serve <socket>\n"
+                        "       clox --loadgen <socket> <requests> <connections>\n"
+                        "       clox --bench-prepared <iterations> <expression> [name...]\n");
         exit(64);
     }
+    stopProfiler();
+    freeStats();
+    freeCompiler();
     freeVM();
     return 0; // Indicate that the program executed successfully.
 }
\ No newline at end of file
@@ -0,0 +1,163 @@
+#define _XOPEN_SOURCE 700
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "vm.h"
+
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_RING_SIZE (1 << 16)
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "the sample ring needs lock-free atomics in a signal handler");
+
+// Samples that resolved to the same line and opcode are counted together.
+typedef struct {
+      int line;
+      uint8_t opcode;
+      uint64_t count;
+} ProfileEntry;
+
+// A single-producer, single-consumer ring: the signal handler pushes offsets and collectSamples() pops them.
+// Both run on the main thread, so the atomics only have to keep the handler and the interrupted code in step.
+static size_t ring[PROFILE_RING_SIZE];
+static atomic_uint ringHead;
+static atomic_uint ringTail;
+static atomic_uint droppedSamples;
+
+static const char* outputPath = NULL;
+static ProfileEntry* entries = NULL;
+static int entryCount = 0;
+static int entryCapacity = 0;
+static uint64_t sampleCount = 0;
+
+static void takeSample(int signal) {
+      (void)signal;
+      Chunk* chunk = vm.chunk;
+      if (chunk == NULL) return;
+
+      // Compare as integers: between scripts vm.ip may still point into an earlier chunk.
+      uintptr_t offset = (uintptr_t)vm.ip - (uintptr_t)chunk->code;
+      if (offset >= (uintptr_t)vm.codeSize) return;
+
+      unsigned head = atomic_load_explicit(&ringHead, memory_order_relaxed);
+      unsigned tail = atomic_load_explicit(&ringTail, memory_order_acquire);
+      if (head - tail == PROFILE_RING_SIZE) {
+            atomic_fetch_add_explicit(&droppedSamples, 1, memory_order_relaxed);
+            return;
+      }
+
+      ring[head % PROFILE_RING_SIZE] = (size_t)offset;
+      atomic_store_explicit(&ringHead, head + 1, memory_order_release);
+}
+
+static void setTimer(long microseconds) {
+      struct itimerval timer;
+      timer.it_interval.tv_sec = microseconds / 1000000;
+      timer.it_interval.tv_usec = microseconds % 1000000;
+      timer.it_value = timer.it_interval;
+      setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+bool startProfiler(const char* path) {
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = takeSample;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+      outputPath = path;
+      setTimer(PROFILE_INTERVAL_US);
+      return true;
+}
+
+static void countSamples(int line, uint8_t opcode, uint64_t count) {
+      sampleCount += count;
+      for (int i = 0; i < entryCount; i++) {
+            if (entries[i].line == line && entries[i].opcode == opcode) {
+                  entries[i].count += count;
+                  return;
+            }
+      }
+
+      if (entryCapacity < entryCount + 1) {
+            int oldCapacity = entryCapacity;
+            entryCapacity = GROW_CAPACITY(oldCapacity);
+            entries = GROW_ARRAY(ProfileEntry, entries, oldCapacity, entryCapacity);
+      }
+      entries[entryCount++] = (ProfileEntry){line, opcode, count};
+}
+
+static int compareOffsets(const void* a, const void* b) {
+      size_t left = *(const size_t*)a;
+      size_t right = *(const size_t*)b;
+      return (left > right) - (left < right);
+}
+
+// The ring never holds more than PROFILE_RING_SIZE offsets, so one drain always fits.
+static size_t drained[PROFILE_RING_SIZE];
+
+// Sorts the offsets so a single walk over the instructions resolves all of them. An offset that lands
+// on an operand, or on the start of the next instruction before it has been dispatched, is charged to
+// the instruction that contains it. Samples at the same instruction are counted together.
+void collectSamples(Chunk* chunk) {
+      if (outputPath == NULL) return;
+      atomic_signal_fence(memory_order_seq_cst); // vm.chunk is cleared before the ring is drained.
+
+      unsigned head = atomic_load_explicit(&ringHead, memory_order_acquire);
+      unsigned tail = atomic_load_explicit(&ringTail, memory_order_relaxed);
+      size_t count = 0;
+      for (; tail != head; tail++) {
+            size_t offset = ring[tail % PROFILE_RING_SIZE];
+            if (offset < chunk->count) drained[count++] = offset;
+      }
+      atomic_store_explicit(&ringTail, tail, memory_order_release);
+      qsort(drained, count, sizeof(size_t), compareOffsets);
+
+      size_t start = 0;
+      for (size_t i = 0; i < count;) {
+            while (start + instructionLength(chunk->code[start]) <= drained[i]) {
+                  start += instructionLength(chunk->code[start]);
+            }
+            size_t end = start + instructionLength(chunk->code[start]);
+            uint64_t samples = 0;
+            for (; i < count && drained[i] < end; i++) samples++;
+            countSamples(chunk->lines[start], chunk->code[start], samples);
+      }
+}
+
+void stopProfiler() {
+      if (outputPath == NULL) return;
+      setTimer(0);
+      signal(SIGPROF, SIG_DFL);
+
+      FILE* out = fopen(outputPath, "w");
+      if (out == NULL) {
+            fprintf(stderr, "Could not open profile output \"%s\".\n", outputPath);
+      } else {
+            for (int i = 0; i < entryCount; i++) {
+                  const char* name = opcodeName(entries[i].opcode);
+                  fprintf(out, "clox;line %d;%s %llu\n", entries[i].line, name != NULL ? name : "unknown",
+                          (unsigned long long)entries[i].count);
+            }
+            fclose(out);
+      }
+
+      unsigned dropped = atomic_load(&droppedSamples);
+      fprintf(stderr, "profile: %llu samples written to %s", (unsigned long long)sampleCount, outputPath);
+      if (dropped > 0) fprintf(stderr, ", %u dropped because the sample ring was full", dropped);
+      fprintf(stderr, "\n");
+
+      FREE_ARRAY(ProfileEntry, entries, entryCapacity);
+      entries = NULL;
+      entryCount = 0;
+      entryCapacity = 0;
+      outputPath = NULL;
+}
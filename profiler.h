@@ -0,0 +1,16 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "chunk.h"
+
+// Starts sampling the VM's instruction pointer on a SIGPROF timer. Samples are written to `path` in the
+// folded format read by flamegraph.pl when stopProfiler() is called. Only scripts run through interpret()
+// or interpretStream() are sampled.
+bool startProfiler(const char* path);
+void stopProfiler();
+
+// Resolves the samples taken while `chunk` was running to opcodes and source lines. Must be called after
+// vm.chunk has been cleared and before the chunk is freed. Does nothing when the profiler is not running.
+void collectSamples(Chunk* chunk);
+
+#endif
@@ -1,21 +1,122 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
 typedef struct {
       const char* start;
       const char* current;
       int line;
+
+      // Streaming mode only. `window` holds the unconsumed input, NUL-terminated at `limit`.
+      FILE* input;
+      char* window;
+      int windowSize;
+      const char* limit;
+      char* lexemes[2];
+      int lexemeCapacity[2];
+      int nextLexeme;
+      int readError;       // errno of a failed read, reported once in place of the end of input.
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
+static _Thread_local char readErrorMessage[128];
 
 void initScanner(const char* source){
       scanner.start = source;
       scanner.current = source;
       scanner.line = 1;
+      scanner.input = NULL;
+      scanner.window = NULL;
+      scanner.windowSize = 0;
+      scanner.limit = NULL;
+      for (int i = 0; i < 2; i++) {
+            scanner.lexemes[i] = NULL;
+            scanner.lexemeCapacity[i] = 0;
+      }
+      scanner.nextLexeme = 0;
+      scanner.readError = 0;
+}
+
+void initStreamScanner(FILE* input, int windowSize){
+      initScanner("");
+      scanner.input = input;
+      scanner.windowSize = windowSize;
+      scanner.window = GROW_ARRAY(char, NULL, 0, windowSize);
+      scanner.window[0] = '\0';
+      scanner.start = scanner.window;
+      scanner.current = scanner.window;
+      scanner.limit = scanner.window;
+}
+
+void freeScanner(){
+      FREE_ARRAY(char, scanner.window, scanner.windowSize);
+      for (int i = 0; i < 2; i++) {
+            FREE_ARRAY(char, scanner.lexemes[i], scanner.lexemeCapacity[i]);
+      }
+      initScanner("");
+}
+
+// Called when the scanner reaches the NUL at the end of the window. Slides the token being
+// scanned to the front of the window and reads more input behind it, so a token that straddles
+// a refill stays contiguous. Returns false once the input is exhausted or can no longer be read.
+static bool refill(){
+      if (scanner.input == NULL) return false;
+
+      int keep = (int)(scanner.limit - scanner.start);
+      int offset = (int)(scanner.current - scanner.start);
+      if (keep + 1 >= scanner.windowSize) {
+            int oldSize = scanner.windowSize;
+            scanner.windowSize = GROW_CAPACITY(oldSize);
+            char* window = GROW_ARRAY(char, NULL, 0, scanner.windowSize);
+            memcpy(window, scanner.start, keep);
+            FREE_ARRAY(char, scanner.window, oldSize);
+            scanner.window = window;
+      } else {
+            memmove(scanner.window, scanner.start, keep);
+      }
+
+      // read() rather than fread(): it returns whatever has arrived instead of waiting for a full
+      // window, so on a pipe the tokens already received are compiled while the rest is on its way.
+      ssize_t result;
+      do {
+            result = read(fileno(scanner.input), scanner.window + keep, scanner.windowSize - 1 - keep);
+      } while (result < 0 && errno == EINTR);
+      if (result < 0) scanner.readError = errno;
+      size_t bytesRead = result > 0 ? (size_t)result : 0;
+      scanner.start = scanner.window;
+      scanner.current = scanner.window + offset;
+      scanner.limit = scanner.window + keep + bytesRead;
+      scanner.window[keep + bytesRead] = '\0';
+
+      if (bytesRead == 0) scanner.input = NULL;
+      return bytesRead > 0;
+}
+
+// The parser holds on to at most two tokens at once, so in streaming mode each lexeme is
+// copied into one of two alternating buffers that outlive the window contents.
+static const char* keepLexeme(const char* start, int length){
+      int slot = scanner.nextLexeme;
+      scanner.nextLexeme = 1 - slot;
+
+      if (scanner.lexemeCapacity[slot] < length + 1) {
+            int oldCapacity = scanner.lexemeCapacity[slot];
+            while (scanner.lexemeCapacity[slot] < length + 1) {
+                  scanner.lexemeCapacity[slot] = GROW_CAPACITY(scanner.lexemeCapacity[slot]);
+            }
+            scanner.lexemes[slot] = GROW_ARRAY(char, scanner.lexemes[slot],
+                                               oldCapacity, scanner.lexemeCapacity[slot]);
+      }
+
+      memcpy(scanner.lexemes[slot], start, length);
+      scanner.lexemes[slot][length] = '\0';
+      return scanner.lexemes[slot];
 }
 
 static bool isAlpha(char c) {
@@ -28,8 +129,13 @@ static bool isDigit(char c) {
       return c >= '0' && c <= '9';
 }
 
+static char peek(){
+      if (*scanner.current == '\0') refill();
+      return *scanner.current;
+}
+
 static bool isAtEnd() {
-      return *scanner.current == '\0';
+      return peek() == '\0';
 }
 
 static char advance(){
@@ -37,12 +143,9 @@ static char advance(){
       return scanner.current[-1];
 }
 
-static char peek(){
-      return *scanner.current;
-}
-
 static char peekNext() {
       if (isAtEnd()) return '\0';
+      if (scanner.current[1] == '\0') refill();
       return scanner.current[1];
 }
 
@@ -59,6 +162,7 @@ static Token makeToken(TokenType type) {
       token.start = scanner.start;
       token.length = (int)(scanner.current - scanner.start);
       token.line = scanner.line;
+      if (scanner.window != NULL) token.start = keepLexeme(token.start, token.length);
       return token;
 }
 
@@ -167,7 +271,16 @@ Token scanToken() {
       skipWhitespace();
       scanner.start = scanner.current;
 
-      if (isAtEnd()) return makeToken(TOKEN_EOF);
+      if (isAtEnd()) {
+            // Input cut short by an I/O error must not compile as if the program ended there.
+            if (scanner.readError != 0) {
+                  snprintf(readErrorMessage, sizeof(readErrorMessage), "Could not read input: %s.",
+                           strerror(scanner.readError));
+                  scanner.readError = 0;
+                  return errorToken(readErrorMessage);
+            }
+            return makeToken(TOKEN_EOF);
+      }
 
       char c = advance();
       if (isAlpha(c)) return identifier();
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stdio.h>
+
 typedef enum {
       TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
       TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
@@ -29,7 +31,14 @@ typedef struct {
       int line;
 } Token;
 
+// Bytes of input the streaming scanner holds at once. A single token longer than this grows the window.
+#define SCANNER_WINDOW_SIZE 65536
+
 void initScanner(const char* source);
+// Scans `input` through a refillable window instead of a NUL-terminated string, so scanning can
+// start before the input ends. Token text stays valid until the token after next is scanned.
+void initStreamScanner(FILE* input, int windowSize);
+void freeScanner();
 Token scanToken();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include <stdio.h>
+
+#include "memory.h"
+#include "scheduler.h"
+
+typedef struct {
+      VM vm;
+      Chunk chunk;
+      bool done;
+      int quanta;
+} Task;
+
+void runScheduled(const char* sources[], int count, size_t quantum, InterpretResult results[]) {
+      Task* tasks = GROW_ARRAY(Task, NULL, 0, count);
+      int running = 0;
+
+      for (int i = 0; i < count; i++) {
+            Task* task = &tasks[i];
+            initChunk(&task->chunk);
+            task->quanta = 0;
+            results[i] = loadChunk(sources[i], &task->chunk);
+            task->done = results[i] != INTERPRET_OK;
+            if (task->done) {
+                  freeChunk(&task->chunk);
+            } else {
+                  saveVM(&task->vm);
+                  running++;
+            }
+      }
+
+      while (running > 0) {
+            for (int i = 0; i < count; i++) {
+                  Task* task = &tasks[i];
+                  if (task->done) continue;
+
+                  restoreVM(&task->vm);
+                  InterpretResult result = resume(quantum);
+                  task->quanta++;
+                  if (result == INTERPRET_YIELD) {
+                        saveVM(&task->vm);
+                        continue;
+                  }
+
+                  results[i] = result;
+                  task->done = true;
+                  freeChunk(&task->chunk);
+                  running--;
+                  fprintf(stderr, "task %d finished after %zu instructions in %d quanta\n",
+                          i, vm.instructionCount, task->quanta);
+            }
+      }
+
+      FREE_ARRAY(Task, tasks, count);
+}
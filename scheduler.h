@@ -0,0 +1,12 @@
+#ifndef clox_scheduler_h
+#define clox_scheduler_h
+
+#include "common.h"
+#include "vm.h"
+
+// Runs every script in `sources` on the calling thread, giving each its own suspended VM and switching
+// round-robin after `quantum` instructions so that no script monopolizes the thread. Each script's
+// final status is written to `results`.
+void runScheduled(const char* sources[], int count, size_t quantum, InterpretResult results[]);
+
+#endif
@@ -0,0 +1,551 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "stats.h"
+#include "vm.h"
+
+#define SERVER_POOL_SIZE 8
+#define SERVER_QUANTUM 10000
+#define SERVER_MAX_REQUEST (1 << 20)
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_INPUT (4 + SERVER_MAX_REQUEST)
+#define READ_CHUNK 65536
+
+typedef struct {
+      char* data;
+      int count;
+      int capacity;
+} Buffer;
+
+typedef struct Connection {
+      int fd;
+      Buffer input;
+      int inputUsed;   // Bytes at the front of input whose requests were already dispatched.
+      Buffer output;
+      int outputSent;
+      uint32_t events; // What the connection is registered with epoll for.
+      bool busy;       // One of this connection's requests is running on a slot.
+      bool hungUp;     // No more requests will be read: the peer finished sending or broke the protocol.
+      bool closed;     // The socket failed, so nothing more can be sent either.
+      struct Connection* next;
+} Connection;
+
+// A pre-initialized VM and the chunk it reuses from one request to the next.
+typedef struct {
+      VM vm;
+      Chunk chunk;
+      Value result;
+      Connection* owner;
+} Slot;
+
+static int epollFd;
+static Connection* connections = NULL;
+static Slot slots[SERVER_POOL_SIZE];
+static int runningSlots = 0;
+static Buffer source;
+static Diagnostics diagnostics;
+
+static void appendBuffer(Buffer* buffer, const void* data, int length) {
+      if (buffer->capacity < buffer->count + length) {
+            int oldCapacity = buffer->capacity;
+            while (buffer->capacity < buffer->count + length) {
+                  buffer->capacity = GROW_CAPACITY(buffer->capacity);
+            }
+            buffer->data = GROW_ARRAY(char, buffer->data, oldCapacity, buffer->capacity);
+      }
+
+      memcpy(buffer->data + buffer->count, data, length);
+      buffer->count += length;
+}
+
+static void consumeBuffer(Buffer* buffer, int length) {
+      memmove(buffer->data, buffer->data + length, buffer->count - length);
+      buffer->count -= length;
+}
+
+static void freeBuffer(Buffer* buffer) {
+      FREE_ARRAY(char, buffer->data, buffer->capacity);
+      buffer->data = NULL;
+      buffer->count = 0;
+      buffer->capacity = 0;
+}
+
+static uint32_t readLength(const char* bytes) {
+      const unsigned char* b = (const unsigned char*)bytes;
+      return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+static void writeLength(char* bytes, uint32_t length) {
+      bytes[0] = (char)(length >> 24);
+      bytes[1] = (char)(length >> 16);
+      bytes[2] = (char)(length >> 8);
+      bytes[3] = (char)length;
+}
+
+static bool setNonBlocking(int fd) {
+      int flags = fcntl(fd, F_GETFL, 0);
+      return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static int unusedInput(Connection* connection) {
+      return connection->input.count - connection->inputUsed;
+}
+
+static bool hasRequest(Connection* connection) {
+      return unusedInput(connection) >= 4 &&
+             (uint32_t)unusedInput(connection) - 4 >= readLength(connection->input.data + connection->inputUsed);
+}
+
+// Whether to read more input: always when the next request is still incomplete, but once one is
+// waiting only until the buffer is half full, so a client pipelining small requests is read in
+// large batches instead of a few bytes each time one is answered.
+static bool wantsInput(Connection* connection) {
+      if (connection->hungUp || connection->closed) return false;
+      return hasRequest(connection) ? unusedInput(connection) < SERVER_MAX_INPUT / 2 :
+                                      unusedInput(connection) < SERVER_MAX_INPUT;
+}
+
+static void flushConnection(Connection* connection) {
+      while (connection->outputSent < connection->output.count) {
+            ssize_t sent = send(connection->fd, connection->output.data + connection->outputSent,
+                                connection->output.count - connection->outputSent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                  if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                  connection->closed = true;
+                  return;
+            }
+            connection->outputSent += (int)sent;
+      }
+
+      if (connection->outputSent == connection->output.count) {
+            connection->output.count = 0;
+            connection->outputSent = 0;
+      }
+}
+
+static void respond(Connection* connection, InterpretResult status, const char* text, int length) {
+      char header[5];
+      writeLength(header, (uint32_t)length + 1);
+      header[4] = (char)status;
+      appendBuffer(&connection->output, header, sizeof(header));
+      appendBuffer(&connection->output, text, length);
+      flushConnection(connection);
+}
+
+static void closeConnection(Connection* connection) {
+      for (Connection** link = &connections; *link != NULL; link = &(*link)->next) {
+            if (*link == connection) {
+                  *link = connection->next;
+                  break;
+            }
+      }
+
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+      close(connection->fd);
+      freeBuffer(&connection->input);
+      freeBuffer(&connection->output);
+      free(connection);
+}
+
+// Closes the connection once nothing is left to do on it: its socket failed, or the peer stopped
+// sending and every request it did send has been answered and flushed. Otherwise registers it for
+// what it is waiting on. Input is only read while the buffer has room, and requests only start
+// while earlier answers aren't backed up, so a client that sends without reading is held back by
+// the socket rather than growing the buffers.
+static void settle(Connection* connection) {
+      if (!connection->busy && (connection->closed ||
+                                (connection->hungUp && connection->output.count == 0 && !hasRequest(connection)))) {
+            closeConnection(connection);
+            return;
+      }
+
+      uint32_t events = 0;
+      if (wantsInput(connection)) events |= EPOLLIN | EPOLLRDHUP;
+      if (connection->output.count > 0 && !connection->closed) events |= EPOLLOUT;
+      if (events == connection->events) return;
+
+      struct epoll_event event;
+      event.events = events;
+      event.data.ptr = connection;
+      epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+      connection->events = events;
+}
+
+static Slot* freeSlot() {
+      for (int i = 0; i < SERVER_POOL_SIZE; i++) {
+            if (slots[i].owner == NULL) return &slots[i];
+      }
+      return NULL;
+}
+
+// Starts the connection's next complete request on a free slot. Requests on one connection run one
+// at a time, so responses come back in request order.
+static void dispatch(Connection* connection) {
+      while (!connection->busy && !connection->closed && connection->output.count == 0 &&
+             unusedInput(connection) >= 4) {
+            const char* request = connection->input.data + connection->inputUsed;
+            uint32_t length = readLength(request);
+            if (length > SERVER_MAX_REQUEST) {
+                  // Nothing after a bad length can be framed, but earlier answers are still delivered.
+                  connection->input.count = 0;
+                  connection->inputUsed = 0;
+                  connection->hungUp = true;
+                  return;
+            }
+            if (!hasRequest(connection)) return;
+
+            Slot* slot = freeSlot();
+            if (slot == NULL) return;
+
+            source.count = 0;
+            appendBuffer(&source, request + 4, (int)length);
+            appendBuffer(&source, "", 1);
+            connection->inputUsed += 4 + (int)length;
+
+            resetChunk(&slot->chunk);
+            diagnostics.length = 0;
+            InterpretResult result = loadChunk(source.data, &slot->chunk);
+            if (result != INTERPRET_OK) {
+                  respond(connection, result, diagnostics.text, diagnostics.length);
+                  continue;
+            }
+
+            vm.result = &slot->result;
+            saveVM(&slot->vm);
+            slot->owner = connection;
+            connection->busy = true;
+            runningSlots++;
+      }
+}
+
+// Gives every busy slot one quantum, answering the requests that finish. A finished request
+// frees a slot, so connections that were waiting for one get another chance afterwards.
+static void runSlots() {
+      bool freed = false;
+      for (int i = 0; i < SERVER_POOL_SIZE; i++) {
+            Slot* slot = &slots[i];
+            if (slot->owner == NULL) continue;
+
+            restoreVM(&slot->vm);
+            InterpretResult result = resume(SERVER_QUANTUM);
+            if (result == INTERPRET_YIELD) {
+                  saveVM(&slot->vm);
+                  continue;
+            }
+
+            Connection* connection = slot->owner;
+            slot->owner = NULL;
+            runningSlots--;
+            connection->busy = false;
+            freed = true;
+
+            char text[VALUE_TEXT_MAX];
+            int length = result == INTERPRET_OK ?
+                  formatValue(text, slot->result, !printfCompatible) : 0;
+            respond(connection, result, text, length);
+
+            dispatch(connection);
+            settle(connection);
+      }
+
+      if (!freed) return;
+      for (Connection* connection = connections; connection != NULL;) {
+            Connection* next = connection->next;
+            dispatch(connection);
+            settle(connection);
+            connection = next;
+      }
+}
+
+static void acceptConnections(int listenFd) {
+      for (;;) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0) return;
+            if (!setNonBlocking(fd)) {
+                  close(fd);
+                  continue;
+            }
+
+            Connection* connection = (Connection*)calloc(1, sizeof(Connection));
+            if (connection == NULL) exit(1);
+            connection->fd = fd;
+            connection->events = EPOLLIN | EPOLLRDHUP;
+            connection->next = connections;
+            connections = connection;
+
+            struct epoll_event event;
+            event.events = connection->events;
+            event.data.ptr = connection;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+      }
+}
+
+static void readConnection(Connection* connection) {
+      // Drop the dispatched requests once they are at least half the buffer, which keeps the copying
+      // proportional to what is read.
+      if (connection->inputUsed > 0 && connection->inputUsed >= unusedInput(connection)) {
+            consumeBuffer(&connection->input, connection->inputUsed);
+            connection->inputUsed = 0;
+      }
+
+      char chunk[READ_CHUNK];
+      while (unusedInput(connection) < SERVER_MAX_INPUT) {
+            int room = SERVER_MAX_INPUT - unusedInput(connection);
+            ssize_t received = recv(connection->fd, chunk, room < READ_CHUNK ? room : READ_CHUNK, 0);
+            if (received > 0) {
+                  appendBuffer(&connection->input, chunk, (int)received);
+                  continue;
+            }
+            if (received == 0) {
+                  // A half-close still wants the answers to what was sent before it.
+                  connection->hungUp = true;
+                  break;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            connection->closed = true;
+            break;
+      }
+}
+
+static int listenOn(const char* path) {
+      struct sockaddr_un address;
+      if (strlen(path) >= sizeof(address.sun_path)) {
+            fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+            return -1;
+      }
+
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      strcpy(address.sun_path, path);
+
+      // Replace a socket left behind by an earlier server, but never delete anything else.
+      struct stat existing;
+      if (lstat(path, &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                  fprintf(stderr, "\"%s\" exists and is not a socket.\n", path);
+                  return -1;
+            }
+            unlink(path);
+      } else if (errno != ENOENT) {
+            perror("Could not check socket path");
+            return -1;
+      }
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+            listen(fd, SOMAXCONN) < 0 || !setNonBlocking(fd)) {
+            perror("Could not listen");
+            if (fd >= 0) close(fd);
+            return -1;
+      }
+      return fd;
+}
+
+int serve(const char* path) {
+      int listenFd = listenOn(path);
+      if (listenFd < 0) return 74;
+
+      // Requests come from untrusted clients, so nesting must not be able to overflow the C stack.
+      iterativeParsing = true;
+      // A client whose request doesn't compile gets the error message as the response text.
+      captureDiagnostics(&diagnostics);
+
+      epollFd = epoll_create1(0);
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.ptr = NULL;
+      epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+      for (int i = 0; i < SERVER_POOL_SIZE; i++) {
+            initChunk(&slots[i].chunk);
+            slots[i].owner = NULL;
+      }
+
+      struct epoll_event events[SERVER_MAX_EVENTS];
+      for (;;) {
+            // Only block while no VM has work left to do.
+            int count = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, runningSlots > 0 ? 0 : -1);
+            if (count < 0 && errno != EINTR) {
+                  perror("epoll_wait");
+                  return 70;
+            }
+
+            for (int i = 0; i < count; i++) {
+                  Connection* connection = (Connection*)events[i].data.ptr;
+                  if (connection == NULL) {
+                        acceptConnections(listenFd);
+                        continue;
+                  }
+
+                  if (events[i].events & EPOLLOUT) flushConnection(connection);
+                  if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                        // Hang-ups and errors are reported even while input isn't watched; then the
+                        // peer is gone for good rather than just done sending.
+                        if (connection->events & EPOLLIN) readConnection(connection);
+                        else connection->closed = true;
+                  }
+                  dispatch(connection);
+                  settle(connection);
+            }
+
+            runSlots();
+      }
+}
+
+typedef struct {
+      int fd;
+      Buffer input;
+      uint64_t sentAt;
+} Client;
+
+static const char* loadExpressions[] = {
+      "1 + 2 * 3",
+      "(10 - 4) / 3",
+      "-(2.5 * 4) + 100",
+      "1 / 3",
+};
+
+static int compareLatency(const void* a, const void* b) {
+      uint64_t left = *(const uint64_t*)a;
+      uint64_t right = *(const uint64_t*)b;
+      return (left > right) - (left < right);
+}
+
+static bool sendRequest(Client* client, int index) {
+      const char* expression = loadExpressions[index % (sizeof(loadExpressions) / sizeof(loadExpressions[0]))];
+      int length = (int)strlen(expression);
+      char request[64];
+      writeLength(request, (uint32_t)length);
+      memcpy(request + 4, expression, length);
+
+      client->sentAt = monotonicNanoseconds();
+      return send(client->fd, request, 4 + length, MSG_NOSIGNAL) == 4 + length;
+}
+
+static int connectTo(const char* path) {
+      struct sockaddr_un address;
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            if (fd >= 0) close(fd);
+            return -1;
+      }
+      return fd;
+}
+
+int runLoadGenerator(const char* path, int requests, int connections) {
+      if (requests <= 0 || connections <= 0) return 64;
+      if (connections > requests) connections = requests;
+
+      Client* clients = (Client*)calloc(connections, sizeof(Client));
+      uint64_t* latencies = (uint64_t*)malloc(sizeof(uint64_t) * requests);
+      if (clients == NULL || latencies == NULL) exit(1);
+
+      int loadFd = epoll_create1(0);
+      int issued = 0;
+      int completed = 0;
+      int failed = 0;
+      uint64_t start = monotonicNanoseconds();
+
+      for (int i = 0; i < connections; i++) {
+            clients[i].fd = connectTo(path);
+            if (clients[i].fd < 0) {
+                  fprintf(stderr, "Could not connect to \"%s\".\n", path);
+                  return 74;
+            }
+
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &clients[i];
+            epoll_ctl(loadFd, EPOLL_CTL_ADD, clients[i].fd, &event);
+            if (!sendRequest(&clients[i], issued++)) return 74;
+      }
+
+      struct epoll_event events[SERVER_MAX_EVENTS];
+      while (completed < requests) {
+            int count = epoll_wait(loadFd, events, SERVER_MAX_EVENTS, -1);
+            if (count < 0 && errno != EINTR) return 74;
+
+            for (int i = 0; i < count; i++) {
+                  Client* client = (Client*)events[i].data.ptr;
+                  char chunk[4096];
+                  ssize_t received = recv(client->fd, chunk, sizeof(chunk), 0);
+                  if (received <= 0) {
+                        fprintf(stderr, "Server closed the connection.\n");
+                        return 74;
+                  }
+                  appendBuffer(&client->input, chunk, (int)received);
+
+                  while (client->input.count >= 4 &&
+                         (uint32_t)client->input.count >= 4 + readLength(client->input.data)) {
+                        uint32_t length = readLength(client->input.data);
+                        if (length == 0 || client->input.data[4] != INTERPRET_OK) failed++;
+                        consumeBuffer(&client->input, 4 + (int)length);
+
+                        latencies[completed++] = monotonicNanoseconds() - client->sentAt;
+                        if (issued < requests && !sendRequest(client, issued++)) return 74;
+                  }
+            }
+      }
+
+      double elapsed = (monotonicNanoseconds() - start) / 1e9;
+      qsort(latencies, requests, sizeof(uint64_t), compareLatency);
+
+      printf("%d requests over %d connections in %.3f s: %.0f requests/s, %d failed\n",
+             requests, connections, elapsed, requests / elapsed, failed);
+      printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+             latencies[(int)(requests * 0.50)] / 1e3,
+             latencies[(int)(requests * 0.90)] / 1e3,
+             latencies[(int)(requests * 0.99)] / 1e3,
+             latencies[(int)(requests * 0.999)] / 1e3,
+             latencies[requests - 1] / 1e3);
+
+      for (int i = 0; i < connections; i++) {
+            close(clients[i].fd);
+            freeBuffer(&clients[i].input);
+      }
+      close(loadFd);
+      free(clients);
+      free(latencies);
+      return failed > 0 ? 70 : 0;
+}
+
+#else
+
+int serve(const char* path) {
+      (void)path;
+      fprintf(stderr, "--serve needs epoll and is only available on Linux.\n");
+      return 64;
+}
+
+int runLoadGenerator(const char* path, int requests, int connections) {
+      (void)path;
+      (void)requests;
+      (void)connections;
+      fprintf(stderr, "--loadgen is only available on Linux.\n");
+      return 64;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef clox_server_h
+#define clox_server_h
+
+#include "common.h"
+
+// Wire format, both directions: a 4-byte big-endian payload length followed by the payload.
+// A request payload is the source of one expression. A response payload is one status byte
+// (an InterpretResult) followed by text: the result for INTERPRET_OK, the error message for
+// INTERPRET_COMPILE_ERROR, and nothing for INTERPRET_RUNTIME_ERROR. A client may pipeline requests
+// and half-close its end once it has sent the last one; every complete request is still answered.
+
+// Serves requests on the Unix domain socket at `path` until the process is killed. Requests are
+// evaluated on a pool of pre-initialized VMs that take turns in instruction quanta, so one slow
+// expression does not hold up the others. Returns an exit code if the server cannot start.
+int serve(const char* path);
+
+// Sends `requests` requests to the server at `path` over `connections` concurrent connections,
+// each keeping one request in flight, and prints requests per second and latency percentiles.
+int runLoadGenerator(const char* path, int requests, int connections);
+
+#endif
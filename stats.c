@@ -0,0 +1,212 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#else
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "scanner.h"
+#include "stats.h"
+
+// Counters are opened in pairs, each pair as one perf event group led by its first counter, so that
+// both counters of a derived ratio are always scheduled on the PMU together.
+typedef enum {
+      COUNTER_INSTRUCTIONS,
+      COUNTER_CYCLES,
+      COUNTER_BRANCHES,
+      COUNTER_BRANCH_MISSES,
+      COUNTER_L1D_MISSES,
+      COUNTER_LLC_MISSES,
+      COUNTER_COUNT
+} Counter;
+
+#define GROUP_COUNT (COUNTER_COUNT / 2)
+
+// Raw cumulative counts, with how long each group has been enabled and how long it actually ran.
+typedef struct {
+      uint64_t values[COUNTER_COUNT];
+      uint64_t enabled[GROUP_COUNT];
+      uint64_t running[GROUP_COUNT];
+} CounterReading;
+
+typedef struct {
+      uint64_t nanoseconds;
+      uint64_t counters[COUNTER_COUNT];
+      uint64_t startNanoseconds;
+      CounterReading start;
+} PhaseStats;
+
+static const char* phaseNames[PHASE_COUNT] = {
+      [PHASE_READ]    = "read",
+      [PHASE_SCAN]    = "scan",
+      [PHASE_COMPILE] = "compile",
+      [PHASE_EXECUTE] = "execute",
+};
+
+static const char* counterNames[COUNTER_COUNT] = {
+      [COUNTER_INSTRUCTIONS]  = "instructions",
+      [COUNTER_CYCLES]        = "cycles",
+      [COUNTER_BRANCHES]      = "branches",
+      [COUNTER_BRANCH_MISSES] = "branch_misses",
+      [COUNTER_L1D_MISSES]    = "l1d_misses",
+      [COUNTER_LLC_MISSES]    = "llc_misses",
+};
+
+bool statsEnabled = false;
+static PhaseStats phases[PHASE_COUNT];
+static int counterFds[COUNTER_COUNT];
+
+uint64_t monotonicNanoseconds() {
+      struct timespec time;
+      clock_gettime(CLOCK_MONOTONIC, &time);
+      return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+#ifdef __linux__
+static int openCounter(uint32_t type, uint64_t config, int groupFd) {
+      struct perf_event_attr attr = {0};
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+static void openPair(Counter leader, uint32_t leaderType, uint64_t leaderConfig,
+                     uint32_t memberType, uint64_t memberConfig) {
+      counterFds[leader] = openCounter(leaderType, leaderConfig, -1);
+      if (counterFds[leader] >= 0) {
+            counterFds[leader + 1] = openCounter(memberType, memberConfig, counterFds[leader]);
+      }
+}
+#endif
+
+// Reads each group through its leader. The values are left unscaled; see endPhase().
+static void readCounters(CounterReading* reading) {
+      for (int leader = 0; leader < COUNTER_COUNT; leader += 2) {
+            reading->values[leader] = 0;
+            reading->values[leader + 1] = 0;
+            reading->enabled[leader / 2] = 0;
+            reading->running[leader / 2] = 0;
+#ifdef __linux__
+            if (counterFds[leader] < 0) continue;
+
+            uint64_t group[5]; // Number of events, time enabled, time running, then one value per event.
+            ssize_t size = read(counterFds[leader], group, sizeof(group));
+            if (size < (ssize_t)(4 * sizeof(uint64_t))) continue;
+
+            reading->enabled[leader / 2] = group[1];
+            reading->running[leader / 2] = group[2];
+            reading->values[leader] = group[3];
+            if (group[0] > 1) reading->values[leader + 1] = group[4];
+#endif
+      }
+}
+
+void initStats() {
+      for (int i = 0; i < COUNTER_COUNT; i++) counterFds[i] = -1;
+      if (!statsEnabled) return;
+
+#ifdef __linux__
+      const uint64_t l1dReadMiss = PERF_COUNT_HW_CACHE_L1D |
+                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      openPair(COUNTER_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+               PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+      openPair(COUNTER_BRANCHES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+               PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+      openPair(COUNTER_L1D_MISSES, PERF_TYPE_HW_CACHE, l1dReadMiss,
+               PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+}
+
+void freeStats() {
+#ifdef __linux__
+      for (int i = 0; i < COUNTER_COUNT; i++) {
+            if (counterFds[i] >= 0) close(counterFds[i]);
+            counterFds[i] = -1;
+      }
+#endif
+}
+
+void beginPhase(Phase phase) {
+      if (!statsEnabled) return;
+      readCounters(&phases[phase].start);
+      phases[phase].startNanoseconds = monotonicNanoseconds();
+}
+
+// When the kernel multiplexes more events than the PMU has counters, a group only counts while it is
+// scheduled. The phase's share of each count is therefore scaled by the phase's own enabled/running
+// ratio, taken from the differences between the two readings; scaling the cumulative readings
+// separately could make the difference negative when the ratio changes during the phase.
+void endPhase(Phase phase) {
+      if (!statsEnabled) return;
+      uint64_t end = monotonicNanoseconds();
+      CounterReading reading;
+      readCounters(&reading);
+
+      PhaseStats* stats = &phases[phase];
+      stats->nanoseconds += end - stats->startNanoseconds;
+      for (int i = 0; i < COUNTER_COUNT; i++) {
+            uint64_t enabled = reading.enabled[i / 2] - stats->start.enabled[i / 2];
+            uint64_t running = reading.running[i / 2] - stats->start.running[i / 2];
+            if (running == 0) continue; // The group was never scheduled during the phase.
+            uint64_t counted = reading.values[i] - stats->start.values[i];
+            stats->counters[i] += (uint64_t)((double)counted * (double)enabled / (double)running);
+      }
+}
+
+void measureScan(const char* source) {
+      if (!statsEnabled) return;
+      beginPhase(PHASE_SCAN);
+      initScanner(source);
+      while (scanToken().type != TOKEN_EOF);
+      endPhase(PHASE_SCAN);
+}
+
+static void writeRatio(FILE* out, const char* name, Counter numerator, Counter denominator,
+                       const PhaseStats* stats) {
+      fprintf(out, ",\"%s\":", name);
+      if (counterFds[numerator] < 0 || counterFds[denominator] < 0 ||
+            stats->counters[denominator] == 0) {
+            fprintf(out, "null");
+      } else {
+            fprintf(out, "%.4f", (double)stats->counters[numerator] / (double)stats->counters[denominator]);
+      }
+}
+
+void writeStats(FILE* out, size_t bytesEmitted, size_t instructionsExecuted) {
+      if (!statsEnabled) return;
+
+      fprintf(out, "{\"phases\":{");
+      for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            const PhaseStats* stats = &phases[phase];
+            fprintf(out, "%s\"%s\":{\"ns\":%llu", phase == 0 ? "" : ",",
+                    phaseNames[phase], (unsigned long long)stats->nanoseconds);
+
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                  if (counterFds[i] < 0) {
+                        fprintf(out, ",\"%s\":null", counterNames[i]);
+                  } else {
+                        fprintf(out, ",\"%s\":%llu", counterNames[i], (unsigned long long)stats->counters[i]);
+                  }
+            }
+
+            writeRatio(out, "ipc", COUNTER_INSTRUCTIONS, COUNTER_CYCLES, stats);
+            writeRatio(out, "branch_miss_rate", COUNTER_BRANCH_MISSES, COUNTER_BRANCHES, stats);
+            fprintf(out, "}");
+      }
+
+      fprintf(out, "},\"bytes_emitted\":%zu,\"instructions_executed\":%zu}\n",
+              bytesEmitted, instructionsExecuted);
+}
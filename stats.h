@@ -0,0 +1,38 @@
+#ifndef clox_stats_h
+#define clox_stats_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Phases of a run that --stats reports separately. PHASE_SCAN is an extra scanning-only pass over the
+// source made in stats mode, because the single-pass compiler interleaves scanning with compiling;
+// PHASE_COMPILE therefore still includes its own scanning.
+typedef enum {
+      PHASE_READ,
+      PHASE_SCAN,
+      PHASE_COMPILE,
+      PHASE_EXECUTE,
+      PHASE_COUNT
+} Phase;
+
+// Reads the monotonic clock, for timing intervals. Works whether or not --stats is set.
+uint64_t monotonicNanoseconds();
+
+// Set by --stats. Every other function here except monotonicNanoseconds() is a no-op while it is false.
+extern bool statsEnabled;
+
+// Opens the hardware counters (Linux only). Phases are still timed when they are unavailable.
+void initStats();
+void freeStats();
+
+void beginPhase(Phase phase);
+void endPhase(Phase phase);
+
+// Times a scanning-only pass over `source` as PHASE_SCAN.
+void measureScan(const char* source);
+
+// Writes the accumulated phase timings and counters as one JSON object.
+void writeStats(FILE* out, size_t bytesEmitted, size_t instructionsExecuted);
+
+#endif
@@ -0,0 +1,91 @@
+#!/bin/sh
+# Checks how results are printed. In the default mode every result must be the shortest text that reads
+# back as the same double; with --printf-g it must match printf("%g"). Known values are compared against
+# fixed text, then random quotients are checked by reading the text back with awk, whose number parsing
+# and printf are the C library's. Only the last line of output, the result, is compared, so builds with
+# DEBUG_TRACE_EXECUTION pass too.
+#
+# Usage: build clox (for example `gcc -std=c11 -O2 -pthread *.c -o clox -lm`), then run
+#     tests/format.sh ./clox
+# It prints "format: ok" and exits 0, or lists each failure and exits 1.
+set -u
+
+clox=${1:?usage: $0 path/to/clox}
+scratch=$(mktemp)
+trap 'rm -f "$scratch"' EXIT
+status=0
+
+# Prints the result of the expression $2, run with the flag $1 (which may be empty).
+result() {
+      printf '%s\n' "$2" > "$scratch"
+      if [ -n "$1" ]; then "$clox" "$1" "$scratch"; else "$clox" "$scratch"; fi | tail -n 1
+}
+
+fail() {
+      echo "FAIL $*" | cut -c 1-160 # The subnormal case's expression is over 4000 characters.
+      status=1
+}
+
+# 0.5 multiplied together 1074 times is the smallest subnormal.
+smallest=$(awk 'BEGIN { printf "1"; for (i = 0; i < 1074; i++) printf "*0.5" }')
+
+# expression | shortest | %g
+while IFS='|' read -r expression shortest printfG; do
+      [ "$(result '' "$expression")" = "$shortest" ] ||
+            fail "$expression: '$(result '' "$expression")', expected '$shortest'"
+      [ "$(result --printf-g "$expression")" = "$printfG" ] ||
+            fail "$expression --printf-g: '$(result --printf-g "$expression")', expected '$printfG'"
+done <<EOF
+1+2|3|3
+1/3|0.3333333333333333|0.333333
+2/3|0.6666666666666666|0.666667
+0.1+0.2|0.30000000000000004|0.3
+-5/2|-2.5|-2.5
+1/10000|0.0001|0.0001
+3/200000|1.5e-05|1.5e-05
+1000000|1000000|1e+06
+1234567.125|1234567.125|1.23457e+06
+100000000000000|100000000000000|1e+14
+1000000000000000|1e+15|1e+15
+9007199254740991|9.007199254740991e+15|9.0072e+15
+1000000000000000000000|1e+21|1e+21
+123456789012345678901234567890|1.2345678901234568e+29|1.23457e+29
+0*-1|-0|-0
+1/0|inf|inf
+-1/0|-inf|-inf
+$smallest|5e-324|4.94066e-324
+EOF
+
+# Random quotients, some scaled down into exponent notation.
+awk 'BEGIN {
+      srand(2024);
+      for (i = 0; i < 150; i++) {
+            a = int(rand() * 1000000) + 1; b = int(rand() * 1000) + 1;
+            if (i % 3 == 0) printf "%d/%d\n", a, b;
+            else if (i % 3 == 1) printf "%d/%d/1000000000\n", a, b;
+            else printf "%d.%d/%d*7\n", a, b, b + 2;
+      }
+}' > "$scratch.cases"
+while read -r expression; do
+      shortest=$(result '' "$expression")
+      printfG=$(result --printf-g "$expression")
+      check=$(awk -v e="$expression" -v t="$shortest" -v g="$printfG" 'BEGIN {
+            # Evaluate e left to right, as clox does for these operator chains.
+            n = split(e, parts, /[\/*]/); v = parts[1] + 0; rest = e; sub(/^[^\/*]*/, "", rest);
+            for (i = 2; i <= n; i++) {
+                  op = substr(rest, 1, 1); rest = substr(rest, length(parts[i]) + 2);
+                  v = (op == "/") ? v / parts[i] : v * parts[i];
+            }
+            if (t + 0 != v) { print "does not read back as " sprintf("%.17g", v); exit }
+            digits = t; sub(/e.*/, "", digits); gsub(/[^0-9]/, "", digits); sub(/^0+/, "", digits);
+            if (length(digits) > 1 && sprintf("%." (length(digits) - 2) "e", v) + 0 == v) {
+                  print "is not the shortest text"; exit
+            }
+            if (sprintf("%g", v) != g) print "--printf-g gave " g ", printf gives " sprintf("%g", v)
+      }')
+      [ -z "$check" ] || fail "$expression -> $shortest: $check"
+done < "$scratch.cases"
+rm -f "$scratch.cases"
+
+[ $status -eq 0 ] && echo "format: ok"
+exit $status
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Checks that -O still compiles an expression with more shared subexpressions than the VM stack has
+# room for as slots, recomputing the ones that don't fit. Usage: tests/shared_slots.sh path/to/clox
+set -u
+
+clox=${1:?usage: $0 path/to/clox}
+status=0
+
+# (x+1)*(x+1)+(x+2)*(x+2)+...: 299 shared sums, each needed twice.
+expression=$(awk 'BEGIN { for (i = 1; i < 300; i++) printf "%s(x+%d)*(x+%d)", (i > 1 ? "+" : ""), i, i }')
+
+for flag in '' '-O'; do
+      if ! output=$("$clox" $flag --bench-prepared 1 "$expression" x 2>&1); then
+            echo "FAIL ${flag:-without -O}: $output"
+            status=1
+      fi
+done
+
+[ $status -eq 0 ] && echo "shared slots: ok"
+exit $status
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Checks that -O prints the same result as the unoptimized compiler for expressions whose value
+# is a signed zero. Only the last line of output, the result, is compared, so the check also holds
+# for builds with DEBUG_TRACE_EXECUTION, whose disassembly and trace differ under -O.
+#
+# Usage: build clox (for example `gcc -std=c11 -O2 -pthread *.c -o clox -lm`), then run
+#     tests/signed_zero.sh ./clox
+# It prints "signed zero: ok" and exits 0, or lists each failing expression and exits 1.
+set -u
+
+clox=${1:?usage: $0 path/to/clox}
+scratch=$(mktemp)
+trap 'rm -f "$scratch"' EXIT
+status=0
+
+for expression in '-0' '-(0)' '0*-1' '-0*0' '0.25*(-0*0)/1.5' '-0+0' '0/-5'; do
+      printf '%s\n' "$expression" > "$scratch"
+      plain=$("$clox" "$scratch" | tail -n 1)
+      optimized=$("$clox" -O "$scratch" | tail -n 1)
+      if [ "$plain" != "$optimized" ]; then
+            echo "FAIL $expression: '$plain' without -O, '$optimized' with -O"
+            status=1
+      fi
+done
+
+[ $status -eq 0 ] && echo "signed zero: ok"
+exit $status
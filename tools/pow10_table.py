@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+"""Prints the rows of `pow10Significands` in value.c.
+
+Row e, for e from POW10_MIN to POW10_MAX, holds g = floor(10^e * 2^(127 - floor(log2(10^e)))) + 1,
+split into its high and low 64-bit halves, so 2^127 <= g < 2^128. The arithmetic is exact
+(fractions.Fraction). Usage: python3 tools/pow10_table.py > rows.txt, then paste the rows between
+the braces of the table.
+"""
+
+from fractions import Fraction
+
+POW10_MIN = -292
+POW10_MAX = 326
+
+
+def floor_log2(x):
+    """floor(log2(x)) for a positive Fraction, computed exactly."""
+    n = x.numerator.bit_length() - x.denominator.bit_length()
+    while Fraction(2) ** n > x:
+        n -= 1
+    while Fraction(2) ** (n + 1) <= x:
+        n += 1
+    return n
+
+
+def main():
+    for e in range(POW10_MIN, POW10_MAX + 1):
+        power = Fraction(10) ** e
+        r = floor_log2(power)
+        assert r == (e * 1741647) >> 19, e  # The approximation shortestDecimal() uses for h.
+        g = (power * Fraction(2) ** (127 - r)).__floor__() + 1
+        assert 2 ** 127 <= g < 2 ** 128
+        print("    {0x%016X, 0x%016X}, // 1e%d" % (g >> 64, g & (2 ** 64 - 1), e))
+
+
+if __name__ == "__main__":
+    main()
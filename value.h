@@ -35,4 +35,12 @@ void freeValueArray(ValueArray* array);
 // Provides a convenient way to display values for debugging or output purposes.
 void printValue(Value value);
 
+// The most bytes `formatValue` writes, including the terminating NUL.
+#define VALUE_TEXT_MAX 32
+
+// Writes a `Value` as text into `buffer`, which must hold `VALUE_TEXT_MAX` bytes, and returns its length.
+// With `shortest` set it writes the shortest text that reads back as the same double; otherwise the text
+// is exactly what `printf("%g")` would produce.
+int formatValue(char* buffer, Value value, bool shortest);
+
 #endif // End of include guard
\ No newline at end of file
@@ -1,12 +1,26 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "profiler.h"
+#include "stats.h"
 #include "vm.h"
 
 
-VM vm;
+_Thread_local VM vm;
+bool printfCompatible = false;
+
+// Results waiting to be written to stdout in bulk. Kept apart from VM so suspended tasks, which
+// are copies of VM, don't each carry a buffer.
+typedef struct {
+    int length;
+    char text[OUTPUT_BUFFER_SIZE];
+} Output;
+
+static _Thread_local Output output;
 
 static void resetStack(){
     vm.stackTop = vm.stack;
@@ -14,10 +28,41 @@ static void resetStack(){
 
 void initVM(){
     resetStack();
+    output.length = 0;
 }
 
 void freeVM(){
+    flushOutput();
+}
+
+void flushOutput(){
+    fflush(stdout);
+    int written = 0;
+    while (written < output.length) {
+        ssize_t result = write(STDOUT_FILENO, output.text + written, output.length - written);
+        if (result <= 0) break;
+        written += (int)result;
+    }
+    output.length = 0;
+}
 
+void writeOutput(const char* text, int length){
+    if (output.length + length > OUTPUT_BUFFER_SIZE) flushOutput();
+    if (length > OUTPUT_BUFFER_SIZE) {
+        fwrite(text, sizeof(char), length, stdout);
+        return;
+    }
+    memcpy(output.text + output.length, text, length);
+    output.length += length;
+}
+
+static void writeResult(Value value){
+    if (output.length + VALUE_TEXT_MAX + 1 > OUTPUT_BUFFER_SIZE) flushOutput();
+    output.length += formatValue(output.text + output.length, value, !printfCompatible);
+    output.text[output.length++] = '\n';
+#ifdef DEBUG_TRACE_EXECUTION
+    flushOutput(); // Keep results in order with the trace, which goes through stdio.
+#endif
 }
 
 void push(Value value){
@@ -33,6 +78,8 @@ Value pop(){
 static InterpretResult run(){
 #define READ_BYTE() (*vm.ip++)
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()]);
+#define READ_SHORT() \
+    (vm.ip += 2, (int16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
 #define BINARY_OP(op) \
     do { \
       double b = pop(); \
@@ -40,7 +87,15 @@ static InterpretResult run(){
       push(a op b); \
     } while (false)
 
+    // Count down in a local so the budget check stays in a register; vm.instructionCount is
+    // brought up to date whenever run() returns.
+    size_t remaining = vm.instructionLimit - vm.instructionCount;
     for (;;){
+        if (remaining == 0) {
+            vm.instructionCount = vm.instructionLimit;
+            return INTERPRET_YIELD;
+        }
+        remaining--;
 #ifdef DEBUG_TRACE_EXECUTION
     printf("          ");
     for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
@@ -49,7 +104,7 @@ static InterpretResult run(){
         printf(" ]");
     }
     printf("\n");
-    disassembleInstruction(vm.chunk, (int) (vm.ip - vm.chunk->code));
+    disassembleInstruction(vm.chunk, (size_t) (vm.ip - vm.chunk->code));
 #endif            
         uint8_t instruction;
         switch (instruction = READ_BYTE()){
@@ -58,6 +113,14 @@ static InterpretResult run(){
                 push(constant);
                 break;
             }
+            case OP_ZERO:       push(0); break;
+            case OP_ONE:        push(1); break;
+            case OP_BYTE:       push(READ_BYTE()); break;
+            case OP_SHORT:      push(READ_SHORT()); break;
+            case OP_FIXED:      push(READ_SHORT() * (1.0 / 256)); break;
+            case OP_GET_PARAM:  push(vm.params[READ_BYTE()]); break;
+            case OP_GET_LOCAL:  push(vm.stack[READ_BYTE()]); break;
+            case OP_SET_LOCAL:  vm.stack[READ_BYTE()] = vm.stackTop[-1]; break;
             case OP_ADD:        BINARY_OP(+); break;
             case OP_SUBTRACT:   BINARY_OP(-); break;
             case OP_MULTIPLY:   BINARY_OP(*); break;
@@ -67,31 +130,133 @@ static InterpretResult run(){
                 break;
             }
             case OP_RETURN:{
-                printValue(pop());
-                printf("\n");
+                vm.instructionCount = vm.instructionLimit - remaining;
+                Value result = pop();
+                if (vm.result != NULL) {
+                    *vm.result = result;
+                } else {
+                    writeResult(result);
+                }
                 return INTERPRET_OK;
             }
         }
     }
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_SHORT
 #undef BINARY_OP
 }
 
+static void startChunk(Chunk* chunk) {
+    resetStack();
+    vm.chunk = chunk;
+    vm.ip = vm.chunk->code;
+    vm.codeSize = chunk->count;
+    vm.result = NULL;
+    vm.params = NULL;
+}
+
+static InterpretResult interpretChunk(Chunk* chunk, bool compiled) {
+    if(!compiled) {
+        endPhase(PHASE_COMPILE);
+        freeChunk(chunk);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    freezeChunk(chunk);
+    endPhase(PHASE_COMPILE);
+    startChunk(chunk);
+    vm.instructionLimit = SIZE_MAX;
+
+    beginPhase(PHASE_EXECUTE);
+    InterpretResult result = run();
+    endPhase(PHASE_EXECUTE);
+
+    // The profiler's signal handler reads through vm.chunk, so it must not outlive the chunk.
+    vm.chunk = NULL;
+    collectSamples(chunk);
+    freeChunk(chunk);
+    return result;
+}
+
 InterpretResult interpret(const char* source) {
     Chunk chunk;
     initChunk(&chunk);
+    vm.codeSize = 0;
+    vm.instructionCount = 0;
+
+    measureScan(source);
+    beginPhase(PHASE_COMPILE);
+    return interpretChunk(&chunk, compile(source, &chunk));
+}
+
+InterpretResult interpretStream(FILE* input) {
+    Chunk chunk;
+    initChunk(&chunk);
+    vm.codeSize = 0;
+    vm.instructionCount = 0;
 
-    if(!compile(source, &chunk)) {
-        freeChunk(&chunk);
+    beginPhase(PHASE_COMPILE);
+    return interpretChunk(&chunk, compileStream(input, &chunk));
+}
+
+InterpretResult loadChunk(const char* source, Chunk* chunk) {
+    vm.codeSize = 0;
+    vm.instructionCount = 0;
+    if (!compile(source, chunk)) return INTERPRET_COMPILE_ERROR;
+
+    flattenChunk(chunk);
+    startChunk(chunk);
+    return INTERPRET_OK;
+}
+
+InterpretResult prepare(const char* source, const char* names[], int count, Chunk* chunk) {
+    if (!compilePrepared(source, names, count, chunk)) {
+        freeChunk(chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    freezeChunk(chunk);
+    return INTERPRET_OK;
+}
 
-    InterpretResult result = run();
+InterpretResult evaluate(Chunk* chunk, const Value* params, Value* result) {
+    startChunk(chunk);
+    vm.params = params;
+    vm.result = result;
+    vm.instructionCount = 0;
+    vm.instructionLimit = SIZE_MAX;
 
-    freeChunk(&chunk);
-    return result;
+    InterpretResult status = run();
+    vm.chunk = NULL; // The caller may free the chunk; see interpretChunk().
+    return status;
+}
+
+// The limit saturates, so resume(SIZE_MAX) after an earlier yield still means "run to the end".
+InterpretResult resume(size_t quantum) {
+    vm.instructionLimit = quantum > SIZE_MAX - vm.instructionCount
+        ? SIZE_MAX : vm.instructionCount + quantum;
+    return run();
+}
+
+// Copies only the live part of the stack, so a switch costs in proportion to the stack depth.
+static void copyVM(VM* to, const VM* from) {
+    size_t depth = from->stackTop - from->stack;
+    to->chunk = from->chunk;
+    to->ip = from->ip;
+    memcpy(to->stack, from->stack, depth * sizeof(Value));
+    to->stackTop = to->stack + depth;
+    to->codeSize = from->codeSize;
+    to->instructionCount = from->instructionCount;
+    to->instructionLimit = from->instructionLimit;
+    to->result = from->result;
+    to->params = from->params;
+}
+
+void saveVM(VM* task) {
+    copyVM(task, &vm);
+}
+
+void restoreVM(const VM* task) {
+    copyVM(&vm, task);
 }
\ No newline at end of file
@@ -1,11 +1,13 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <stdio.h>
 
 #include "chunk.h"
 #include "value.h"
 
 #define STACK_MAX 256
+#define OUTPUT_BUFFER_SIZE 65536
 
 typedef struct 
 {
@@ -13,17 +15,53 @@ typedef struct
     uint8_t* ip;
     Value stack[STACK_MAX];
     Value* stackTop;
+    size_t codeSize;
+    size_t instructionCount;
+    size_t instructionLimit; // run() yields when instructionCount reaches this.
+    Value* result;           // Where OP_RETURN stores the result; NULL prints it instead.
+    const Value* params;     // Values of a prepared expression's parameters, read by OP_GET_PARAM.
 } VM;
 
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_YIELD          // The instruction budget ran out; call resume() to continue.
 } InterpretResult;
 
+// Each thread runs its own VM.
+extern _Thread_local VM vm;
+
+// Set by --printf-g: print results exactly as printf("%g") would instead of as the shortest round-trip text.
+extern bool printfCompatible;
+
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretStream(FILE* input);
+
+// Compiles `source` into `chunk` and points the VM at its first instruction without running it.
+// The chunk must stay alive until the script finishes. It is left writable, so its buffers can be
+// reused for the next script with resetChunk().
+InterpretResult loadChunk(const char* source, Chunk* chunk);
+// Runs the loaded script for at most `quantum` instructions. Returns INTERPRET_YIELD with the
+// instruction pointer and stack preserved if it has not finished.
+InterpretResult resume(size_t quantum);
+// Compiles `source`, with each name in `names` standing for the parameter at the same index, into a
+// frozen chunk that evaluate() can run any number of times. Free it with freeChunk().
+InterpretResult prepare(const char* source, const char* names[], int count, Chunk* chunk);
+// Runs a prepared chunk with `params` bound to its parameters and stores its value in `*result`.
+// Allocates nothing, so it is cheap to call in a loop.
+InterpretResult evaluate(Chunk* chunk, const Value* params, Value* result);
+// Copy the running state of the VM out to, or back in from, a suspended task.
+void saveVM(VM* task);
+void restoreVM(const VM* task);
+
+// Appends text to this thread's output buffer, writing the buffer out first if it is full.
+void writeOutput(const char* text, int length);
+// Writes everything buffered so far to stdout, after anything still pending in stdio.
+void flushOutput();
+
 void push(Value value);
 Value pop();
 